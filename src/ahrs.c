@@ -9,9 +9,7 @@
 #include <assert.h>
 #include <string.h>
 
-#ifndef IEEE754
-#include <math.h> // to deserialize floats from trax
-#endif
+#include <math.h>
 
 #include <stdint.h>
 #include <stdio.h>
@@ -20,50 +18,1008 @@
 #include "io_ahrs.h"
 #include "crc_xmodem.h"
 #include "dbg.h"
+#include "dlog.h"
 #include "macrodef.h"
+#include "trace.h"
 
 
 #define BAUD 38400UL
+// 1 start bit + 8 data bits + 1 stop bit
+#define BYTE_USEC (10UL * 1000000UL / BAUD)
+
+#ifndef AHRS_GAP_BYTES
+// Default intra-datagram gap, in byte times, that resets parse_att(). Generous
+// since usb serial adapters deliver bytes in bursts up to ~16ms apart.
+#define AHRS_GAP_BYTES 100U
+#endif
+
+#ifndef AHRS_PREDICT_MAX_USEC
+// Longest interval ahrs_att_predicted() will extrapolate over
+#define AHRS_PREDICT_MAX_USEC 250000L
+#endif
+
+#ifdef AHRS_GYRO
+#ifndef AHRS_GYRO_MAX_EXP
+// Angular rates of 2^AHRS_GYRO_MAX_EXP rad/s or more, over 7000 deg/s by
+// default, fail the datagram, as do infinite and NaN ones
+#define AHRS_GYRO_MAX_EXP 7
+#endif
+#endif
+
+#ifndef AHRS_RESPONSE_USEC
+// How long to wait for the ahrs to respond to a command
+#define AHRS_RESPONSE_USEC 500000UL
+#endif
+
+#ifndef AHRS_PROBE_USEC
+// How long ahrs_start() waits for each kGetModInfo probe to be answered
+#define AHRS_PROBE_USEC 50000UL
+#endif
+
+#ifndef AHRS_RECONNECT_USEC
+// How long ahrs_reconnect() gives the ahrs to come back up
+#define AHRS_RECONNECT_USEC 2000000UL
+#endif
+
+// Longest datagram sent or expected in response to a command, including a
+// kGetDataResp with somewhat more data components than parse_att() expects
+#define AHRS_FRAME_MAX 64U
+
+#ifndef AHRS_NHANDLERS
+// Maximum number of ahrs_sample_handler_add() handlers
+#define AHRS_NHANDLERS 4
+#endif
+
+#ifndef AHRS_NSUBSCRIBERS
+// Maximum number of ahrs_subscribe() subscribers
+#define AHRS_NSUBSCRIBERS 4
+#endif
+
+#ifdef AHRS_QUEUE
+#ifndef AHRS_QUEUE_LEN
+// Data sets ahrs_drain() can fall behind by before they are dropped
+#ifdef AVR
+#define AHRS_QUEUE_LEN 16U
+#else
+#define AHRS_QUEUE_LEN 256U
+#endif
+#endif
+#if AHRS_QUEUE_LEN & (AHRS_QUEUE_LEN - 1)
+#error "AHRS_QUEUE_LEN must be a power of 2."
+#endif
+#if defined(AVR) && AHRS_QUEUE_LEN > 128
+#error "AHRS_QUEUE_LEN must be at most 128 on avr."
+#endif
+// Queue indices run to twice the length, to tell a full queue from an empty
+// one
+#define QUEUE_INDEX_MASK (2U * AHRS_QUEUE_LEN - 1U)
+#endif
+
+#ifdef AHRS_CLOCK
+#ifndef AHRS_CLOCK_MEMORY
+// Data sets ahrs_att_sensor_time() averages over once locked, at most 255
+#define AHRS_CLOCK_MEMORY 64U
+#endif
+#ifndef AHRS_CLOCK_MAX_SKIP
+// Most sample intervals between data sets before the clock estimate restarts
+#define AHRS_CLOCK_MAX_SKIP 16U
+#endif
+#endif
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
 
 // TODO: change this to defines
 
-// 2 Byte Count + 1 Frame Id + 1 ID Count + 3 * (1 Component ID + 4 float32) +
-// 2 CRC
-static uint_fast16_t const DATAGRAM_BYTECOUNT = 23U;
-static unsigned char const FRAME_ID = 0x05U; // kGetDataResp command
-// 1 Heading + 1 Pitch + 1 Roll + 1 HeadingStatus (in any order in payload)
-static uint_fast8_t const ID_COUNT = 4U;
+#ifdef AHRS_GYRO
+// 2 Byte Count + 1 Frame Id + 1 ID Count + 6 * (1 Component ID + 4 float32) +
+// 1 Component ID + 1 HeadingStatus + 2 CRC
+static uint_fast16_t const DATAGRAM_BYTECOUNT = 38U;
+// 1 Heading + 1 Pitch + 1 Roll + 1 HeadingStatus + 1 GyroX + 1 GyroY +
+// 1 GyroZ (in any order in payload)
+static uint_fast8_t const ID_COUNT = 7U;
+
+static uint16_t const CRC_POST_ID_COUNT = 0xBB74U; // crc of first 4 assumed byte values
+#else
+// 2 Byte Count + 1 Frame Id + 1 ID Count + 3 * (1 Component ID + 4 float32) +
+// 1 Component ID + 1 HeadingStatus + 2 CRC
+static uint_fast16_t const DATAGRAM_BYTECOUNT = 23U;
+// 1 Heading + 1 Pitch + 1 Roll + 1 HeadingStatus (in any order in payload)
+static uint_fast8_t const ID_COUNT = 4U;
+
+static uint16_t const CRC_POST_ID_COUNT = 0x7982U; // crc of first 4 assumed byte values
+#endif
+static unsigned char const FRAME_ID = 0x05U; // kGetDataResp command
+
+
+float const ahrs_range[NUM_ATT_AXES][2] = {
+	[PITCH] = {[COMPONENT_MIN] = -90.f, [COMPONENT_MAX] = 90.f},
+	[YAW] = {[COMPONENT_MIN] = 0.f, [COMPONENT_MAX] = 360.f /* Should technically be the next lower float */},
+	[ROLL] = {[COMPONENT_MIN] = -180.f, [COMPONENT_MAX] = 180.f}};
+
+// triple buffer coordinated with io_ahrs_tripbuf... functions
+static struct ahrs_sample ahrs[3];
+
+// latest sample for any number of readers, coordinated with
+// io_ahrs_seqlock... functions
+static struct ahrs_sample published;
+
+
+float ahrs_att(enum att_axis const dir)
+{
+	return ahrs[io_ahrs_tripbuf_read()].att[dir];
+}
+
+uint_fast8_t ahrs_headingstatus()
+{
+	return ahrs[io_ahrs_tripbuf_read()].headingstatus;
+}
+
+io_ahrs_usec ahrs_att_time()
+{
+	return ahrs[io_ahrs_tripbuf_read()].time;
+}
+
+#ifdef AHRS_CLOCK
+io_ahrs_usec ahrs_att_sensor_time()
+{
+	return ahrs[io_ahrs_tripbuf_read()].sensor_time;
+}
+
+float ahrs_att_jitter()
+{
+	return ahrs[io_ahrs_tripbuf_read()].jitter;
+}
+#endif
+
+/*
+ * returns a wrapped into [min, min + 360)
+ */
+static float wrap_deg(float a, float const min)
+{
+	// in constant time, since a may be far out of range, eg extrapolated
+	a = fmodf(a - min, 360.f);
+	if (a < 0.f)
+	{
+		a += 360.f;
+	}
+	a += min;
+	// rounding may leave it on the upper bound
+	return a < min + 360.f ? a : min;
+}
+
+#if defined(AHRS_GYRO) || defined(AHRS_CLOCK)
+/*
+ * returns later - earlier in seconds. Timestamps may wrap, so a difference of
+ * more than half the range of io_ahrs_usec is taken to be negative.
+ */
+static float usec_elapsed(io_ahrs_usec const later, io_ahrs_usec const earlier)
+{
+	io_ahrs_usec const d = later - earlier;
+	if (d <= (io_ahrs_usec)-1 / 2)
+	{
+		return d * 1e-6f;
+	}
+	return -((io_ahrs_usec)(earlier - later) * 1e-6f);
+}
+#endif
+
+#ifdef AHRS_GYRO
+float ahrs_gyro(enum gyro_axis const axis)
+{
+	return ahrs[io_ahrs_tripbuf_read()].gyro[axis];
+}
+
+/*
+ * Integrates the Euler angle rates given by the body angular rates over the
+ * interval, holding the rates constant. Angles are assumed to be aerospace
+ * convention Z-Y-X (heading, then pitch, then roll) in an x forward, y right,
+ * z down frame, which is the convention the ahrs reports them in.
+ */
+void ahrs_att_predicted(io_ahrs_usec const now, float att[NUM_ATT_AXES])
+{
+	struct ahrs_sample const *const a = &ahrs[io_ahrs_tripbuf_read()];
+
+	float dt = usec_elapsed(now, a->time);
+	dt = TRUNC(-AHRS_PREDICT_MAX_USEC * 1e-6f, dt, AHRS_PREDICT_MAX_USEC * 1e-6f);
+
+	float const deg = 180.f / (float)M_PI;
+	float const p = a->gyro[GYRO_X];
+	float const q = a->gyro[GYRO_Y];
+	float const r = a->gyro[GYRO_Z];
+	float const sin_roll = sinf(a->att[ROLL] / deg);
+	float const cos_roll = cosf(a->att[ROLL] / deg);
+	// keep away from gimbal lock, where heading and roll rates are unbounded
+	float const cos_pitch = fmaxf(cosf(a->att[PITCH] / deg), 1e-3f);
+	float const tan_pitch = sinf(a->att[PITCH] / deg) / cos_pitch;
+
+	float const rate_pitch = q * cos_roll - r * sin_roll;
+	float const rate_yaw = (q * sin_roll + r * cos_roll) / cos_pitch;
+	float const rate_roll = p + (q * sin_roll + r * cos_roll) * tan_pitch;
+
+	float const pitch = a->att[PITCH] + rate_pitch * deg * dt;
+	att[PITCH] = TRUNC(ahrs_range[PITCH][COMPONENT_MIN], pitch,
+			ahrs_range[PITCH][COMPONENT_MAX]);
+	att[YAW] = wrap_deg(a->att[YAW] + rate_yaw * deg * dt,
+			ahrs_range[YAW][COMPONENT_MIN]);
+	att[ROLL] = wrap_deg(a->att[ROLL] + rate_roll * deg * dt,
+			ahrs_range[ROLL][COMPONENT_MIN]);
+}
+#endif
+
+// Bits of struct derived's valid, for which of its members are computed
+enum
+{
+	DERIVED_TRIG = 1U << 0,
+	DERIVED_HALF_TRIG = 1U << 1,
+	DERIVED_ROTATION = 1U << 2,
+	DERIVED_QUATERNION = 1U << 3,
+	DERIVED_GRAVITY = 1U << 4,
+	DERIVED_HEADING = 1U << 5
+};
+
+/*
+ * Quantities derived from each triple buffer slot, computed lazily by the
+ * consumer. parse_att() clears valid when it starts writing a slot, and the
+ * triple buffer hands it to the consumer along with the rest of the slot.
+ */
+static struct derived
+{
+	uint_fast8_t valid;
+	// of the angles, and of half the angles, indexed by enum att_axis
+	float sin[NUM_ATT_AXES], cos[NUM_ATT_AXES];
+	float sin_half[NUM_ATT_AXES], cos_half[NUM_ATT_AXES];
+	float rotation[9];
+	float quaternion[4];
+	float gravity[3];
+	float heading;
+} derived[3];
+
+/*
+ * Sets m to the rotation matrix, row major, of the Z-Y-X Euler angles with
+ * sines s and cosines c, indexed by enum att_axis, per ahrs_att_rotation()
+ */
+static void trig_to_rotation(float const s[NUM_ATT_AXES],
+		float const c[NUM_ATT_AXES], float m[9])
+{
+	float const sp = s[PITCH], cp = c[PITCH];
+	float const sy = s[YAW], cy = c[YAW];
+	float const sr = s[ROLL], cr = c[ROLL];
+	m[0] = cp * cy;
+	m[1] = sr * sp * cy - cr * sy;
+	m[2] = cr * sp * cy + sr * sy;
+	m[3] = cp * sy;
+	m[4] = sr * sp * sy + cr * cy;
+	m[5] = cr * sp * sy - sr * cy;
+	m[6] = -sp;
+	m[7] = sr * cp;
+	m[8] = cr * cp;
+}
+
+/*
+ * returns the derived quantities of the current slot, with at least those in
+ * need computed
+ */
+static struct derived *derive(uint_fast8_t const need)
+{
+	unsigned char const idx = io_ahrs_tripbuf_read();
+	struct derived *const d = &derived[idx];
+	if (!(need & ~d->valid))
+	{
+		return d;
+	}
+	float const rad = (float)M_PI / 180.f;
+	float const *const att = ahrs[idx].att;
+
+	if (need & (DERIVED_ROTATION | DERIVED_GRAVITY) &&
+			!(d->valid & DERIVED_TRIG))
+	{
+		for (uint_fast8_t i = 0; i < NUM_ATT_AXES; ++i)
+		{
+			d->sin[i] = sinf(att[i] * rad);
+			d->cos[i] = cosf(att[i] * rad);
+		}
+		d->valid |= DERIVED_TRIG;
+	}
+	if (need & DERIVED_QUATERNION && !(d->valid & DERIVED_HALF_TRIG))
+	{
+		for (uint_fast8_t i = 0; i < NUM_ATT_AXES; ++i)
+		{
+			d->sin_half[i] = sinf(att[i] * rad / 2);
+			d->cos_half[i] = cosf(att[i] * rad / 2);
+		}
+		d->valid |= DERIVED_HALF_TRIG;
+	}
+
+	if (need & ~d->valid & DERIVED_ROTATION)
+	{
+		trig_to_rotation(d->sin, d->cos, d->rotation);
+		d->valid |= DERIVED_ROTATION;
+	}
+	if (need & ~d->valid & DERIVED_GRAVITY)
+	{
+		// down in the body frame, the bottom row of the rotation matrix
+		float const sp = d->sin[PITCH], cp = d->cos[PITCH];
+		float const sr = d->sin[ROLL], cr = d->cos[ROLL];
+		d->gravity[0] = -sp;
+		d->gravity[1] = sr * cp;
+		d->gravity[2] = cr * cp;
+		d->valid |= DERIVED_GRAVITY;
+	}
+	if (need & ~d->valid & DERIVED_QUATERNION)
+	{
+		float const shp = d->sin_half[PITCH], chp = d->cos_half[PITCH];
+		float const shy = d->sin_half[YAW], chy = d->cos_half[YAW];
+		float const shr = d->sin_half[ROLL], chr = d->cos_half[ROLL];
+		d->quaternion[0] = chr * chp * chy + shr * shp * shy;
+		d->quaternion[1] = shr * chp * chy - chr * shp * shy;
+		d->quaternion[2] = chr * shp * chy + shr * chp * shy;
+		d->quaternion[3] = chr * chp * shy - shr * shp * chy;
+		d->valid |= DERIVED_QUATERNION;
+	}
+	if (need & ~d->valid & DERIVED_HEADING)
+	{
+		// Heading unwrapped as of the last slot it was computed for. Only
+		// the consumer touches these.
+		static float last_yaw, last_heading;
+		static bool started;
+		if (started)
+		{
+			float delta = att[YAW] - last_yaw;
+			if (delta > 180.f)
+			{
+				delta -= 360.f;
+			}
+			else if (delta < -180.f)
+			{
+				delta += 360.f;
+			}
+			last_heading += delta;
+		}
+		else
+		{
+			last_heading = att[YAW];
+			started = true;
+		}
+		last_yaw = att[YAW];
+		d->heading = last_heading;
+		d->valid |= DERIVED_HEADING;
+	}
+	return d;
+}
+
+float const *ahrs_att_rotation()
+{
+	return derive(DERIVED_ROTATION)->rotation;
+}
+
+float const *ahrs_att_quaternion()
+{
+	return derive(DERIVED_QUATERNION)->quaternion;
+}
+
+float const *ahrs_att_gravity()
+{
+	return derive(DERIVED_GRAVITY)->gravity;
+}
+
+float ahrs_att_heading_unwrapped()
+{
+	return derive(DERIVED_HEADING)->heading;
+}
+
+bool ahrs_att_update()
+{
+	return io_ahrs_tripbuf_update();
+}
+
+unsigned long ahrs_att_snapshot(struct ahrs_sample *const sample)
+{
+	unsigned seq;
+	do
+	{
+		seq = io_ahrs_seqlock_read_begin();
+		*sample = published;
+	} while (io_ahrs_seqlock_read_retry(seq));
+	// seq is incremented once before and once after each publish
+	return seq / 2;
+}
+
+static void (*handlers[AHRS_NHANDLERS])(struct ahrs_sample const *);
+static uint_fast8_t nhandlers;
+
+int ahrs_sample_handler_add(void (*const handler)(struct ahrs_sample const *))
+{
+	if (nhandlers == COUNTOF(handlers))
+	{
+		DEBUG("No room for another sample handler.");
+		return -1;
+	}
+	handlers[nhandlers++] = handler;
+	return 0;
+}
+
+#ifdef AHRS_QUEUE
+// single producer, single consumer queue coordinated with io_ahrs_queue...
+// functions
+static struct ahrs_sample queue[AHRS_QUEUE_LEN];
+// number of data sets dropped while the queue was full just before each one
+static uint_least16_t queue_dropped[AHRS_QUEUE_LEN];
+// total of queue_dropped of the data sets drained, for the consumer only
+static unsigned long queue_overflows;
+
+static void queue_push(struct ahrs_sample const *const sample)
+{
+	// only the producer sets head, so it needn't be loaded
+	static unsigned head;
+	static uint_least16_t dropped;
+	if (((head - io_ahrs_queue_tail()) & QUEUE_INDEX_MASK) == AHRS_QUEUE_LEN)
+	{
+		if (dropped < UINT_LEAST16_MAX)
+		{
+			++dropped;
+		}
+		return;
+	}
+	queue[head % AHRS_QUEUE_LEN] = *sample;
+	queue_dropped[head % AHRS_QUEUE_LEN] = dropped;
+	dropped = 0;
+	head = (head + 1U) & QUEUE_INDEX_MASK;
+	io_ahrs_queue_head_set(head);
+}
+
+size_t ahrs_drain(struct ahrs_sample *const buf, size_t const max)
+{
+	// only the consumer sets tail, so it needn't be loaded
+	static unsigned tail;
+	size_t n = (io_ahrs_queue_head() - tail) & QUEUE_INDEX_MASK;
+	if (n > max)
+	{
+		n = max;
+	}
+	for (size_t i = 0; i < n; ++i)
+	{
+		buf[i] = queue[tail % AHRS_QUEUE_LEN];
+		queue_overflows += queue_dropped[tail % AHRS_QUEUE_LEN];
+		tail = (tail + 1U) & QUEUE_INDEX_MASK;
+	}
+	if (n)
+	{
+		io_ahrs_queue_tail_set(tail);
+	}
+	return n;
+}
+
+unsigned long ahrs_queue_overflows()
+{
+	return queue_overflows;
+}
+#endif
+
+static struct subscriber
+{
+	void (*handler)(struct ahrs_sample const *);
+	enum ahrs_reduce reduce;
+	io_ahrs_usec interval;
+	// when the next sample is to be delivered, or on avr, how many data sets
+	// until then
+	io_ahrs_usec due;
+	// Reduction of the samples since the last one delivered. Angles are
+	// summed relative to those of the first, so that AHRS_REDUCE_ANGULAR can
+	// wrap each difference.
+	uint_fast16_t n;
+	struct ahrs_sample first;
+	float sum[NUM_ATT_AXES];
+#ifdef AHRS_GYRO
+	float gyro_sum[NUM_GYRO_AXES];
+#endif
+	uint_fast8_t headingstatus; // worst
+} subscribers[AHRS_NSUBSCRIBERS];
+static uint_fast8_t nsubscribers;
+
+int ahrs_subscribe(io_ahrs_usec const interval, enum ahrs_reduce const reduce,
+		void (*const handler)(struct ahrs_sample const *))
+{
+	if (nsubscribers == COUNTOF(subscribers))
+	{
+		DEBUG("No room for another subscriber.");
+		return -1;
+	}
+	subscribers[nsubscribers++] = (struct subscriber){
+		.handler = handler,
+		.reduce = reduce,
+		.interval = interval};
+	return 0;
+}
+
+/*
+ * Adds sample to the reduction of subscriber sub, and delivers the result if
+ * it is due.
+ */
+static void subscriber_add(struct subscriber *const sub,
+		struct ahrs_sample const *const sample)
+{
+	if (sub->reduce != AHRS_REDUCE_LATEST)
+	{
+		if (!sub->n)
+		{
+			sub->first = *sample;
+			sub->headingstatus = 0;
+			for (uint_fast8_t i = 0; i < NUM_ATT_AXES; ++i)
+			{
+				sub->sum[i] = 0.f;
+			}
+#ifdef AHRS_GYRO
+			for (uint_fast8_t i = 0; i < NUM_GYRO_AXES; ++i)
+			{
+				sub->gyro_sum[i] = 0.f;
+			}
+#endif
+		}
+		++sub->n;
+		for (uint_fast8_t i = 0; i < NUM_ATT_AXES; ++i)
+		{
+			float d = sample->att[i] - sub->first.att[i];
+			if (sub->reduce == AHRS_REDUCE_ANGULAR && i != PITCH)
+			{
+				d = wrap_deg(d, -180.f);
+			}
+			sub->sum[i] += d;
+		}
+#ifdef AHRS_GYRO
+		for (uint_fast8_t i = 0; i < NUM_GYRO_AXES; ++i)
+		{
+			sub->gyro_sum[i] += sample->gyro[i];
+		}
+#endif
+		if (sample->headingstatus > sub->headingstatus)
+		{
+			sub->headingstatus = sample->headingstatus;
+		}
+	}
+
+#ifdef AVR
+	// io_ahrs_time() is 0 on avr unless the application provides it, so the
+	// interval is counted in data sets instead, with due the number still
+	// to come. The very first sample is always delivered.
+	if (sub->due && --sub->due)
+	{
+		return;
+	}
+	sub->due = sub->interval;
+#else
+	// Not yet due if due is later than now, allowing for wrapping. The very
+	// first sample is always delivered.
+	io_ahrs_usec const early = sub->due - sample->time;
+	if (sub->due && early && early <= (io_ahrs_usec)-1 / 2)
+	{
+		return;
+	}
+	// Keep to the interval, unless this is an interval or more late, eg
+	// after the ahrs has stopped sending.
+	sub->due = sample->time - sub->due < sub->interval ?
+		sub->due + sub->interval : sample->time + sub->interval;
+	if (!sub->due)
+	{
+		sub->due = 1; // 0 is reserved for not yet started
+	}
+#endif
+
+	if (sub->reduce == AHRS_REDUCE_LATEST)
+	{
+		sub->handler(sample);
+		return;
+	}
+	struct ahrs_sample mean = *sample;
+	// time of the middle of the interval reduced
+	mean.time = sub->first.time + (sample->time - sub->first.time) / 2;
+	mean.headingstatus = sub->headingstatus;
+	for (uint_fast8_t i = 0; i < NUM_ATT_AXES; ++i)
+	{
+		mean.att[i] = sub->first.att[i] + sub->sum[i] / sub->n;
+		if (sub->reduce == AHRS_REDUCE_ANGULAR && i != PITCH)
+		{
+			mean.att[i] = wrap_deg(mean.att[i], ahrs_range[i][COMPONENT_MIN]);
+		}
+#ifdef AHRS_COMPACT
+		mean.compact.att[i] = ahrs_deg_to_bam(mean.att[i]);
+#endif
+	}
+#ifdef AHRS_GYRO
+	for (uint_fast8_t i = 0; i < NUM_GYRO_AXES; ++i)
+	{
+		mean.gyro[i] = sub->gyro_sum[i] / sub->n;
+	}
+#endif
+#ifdef AHRS_COMPACT
+	mean.compact.headingstatus = mean.headingstatus;
+#endif
+	sub->n = 0;
+	sub->handler(&mean);
+}
+
+#ifdef AHRS_CLOCK
+/*
+ * Estimate of the sample clock of the ahrs, as an alpha-beta filter (ie a
+ * second order pll) on the arrival times of data sets. Its gains start as
+ * those of a least squares line fit to all the arrival times so far, so that
+ * it locks in a few samples, and settle at those of a fit to about the last
+ * AHRS_CLOCK_MEMORY.
+ *
+ * Arrivals can be delayed by more than a sample interval, eg by a usb
+ * latency timer or by scheduling, so they can't be used to count sample
+ * intervals. Instead each data set is taken to be sampled an interval after
+ * the last, unless bytes were discarded in between.
+ */
+static struct
+{
+	io_ahrs_usec phase; // sensor time of the last data set, whole us
+	float phase_frac; // and the rest of it, in us
+	float period; // sample interval, us
+	float var; // mean square of the arrival time residuals, us^2
+	float bias; // recent mean of the residuals, us
+	uint_fast8_t n; // data sets fit, up to AHRS_CLOCK_MEMORY
+	// bytes parsed since the last data set, or UINT_FAST16_MAX if some may
+	// have been missed
+	uint_fast16_t nbytes;
+} sample_clock;
+
+/*
+ * Fills in the sensor time and jitter of sample from its arrival time.
+ */
+static void clock_update(struct ahrs_sample *const sample)
+{
+	io_ahrs_usec const arrival = sample->time;
+	bool const lost = sample_clock.nbytes != DATAGRAM_BYTECOUNT;
+	sample_clock.nbytes = 0;
+	if (sample_clock.n >= 2)
+	{
+		bool const locked = sample_clock.n == AHRS_CLOCK_MEMORY;
+		float const dt = usec_elapsed(arrival, sample_clock.phase) * 1e6f -
+				sample_clock.phase_frac;
+		float const k = lost ? fmaxf(roundf(dt / sample_clock.period), 1.f) :
+				1.f;
+		float const err = dt - k * sample_clock.period;
+		// limits the pull of occasional long delays once locked
+		float const limit = locked ? 3.f * sqrtf(sample_clock.var) : INFINITY;
+		float const e = TRUNC(-limit, err, limit);
+		sample_clock.bias += (e - sample_clock.bias) * (1.f / 16);
+		// A consistent residual means the sample interval has changed, eg
+		// by kSetAcqParams, or data sets were lost unnoticed, which the fit
+		// would take too long to follow. Until locked, the interval is too
+		// rough to tell how many data sets were lost.
+		if ((lost && !locked) || dt > AHRS_CLOCK_MAX_SKIP * sample_clock.period
+				|| (locked &&
+				fabsf(sample_clock.bias) > sample_clock.period * 0.5f))
+		{
+			sample_clock.n = 0;
+		}
+		else
+		{
+			if (!locked)
+			{
+				++sample_clock.n;
+			}
+			float const n = sample_clock.n;
+			sample_clock.var += (err * err - sample_clock.var) / n;
+			float const alpha = 2.f * (2.f * n - 1.f) / (n * (n + 1.f));
+			float const beta = 6.f / (n * (n + 1.f));
+			sample_clock.phase_frac += k * sample_clock.period + alpha * e;
+			sample_clock.period += beta * e / k;
+
+			float const whole = floorf(sample_clock.phase_frac);
+			sample_clock.phase += (io_ahrs_usec)(int32_t)whole;
+			sample_clock.phase_frac -= whole;
+		}
+	}
+	else if (sample_clock.n == 1 && !lost)
+	{
+		// arrivals in the same chunk say nothing about the interval
+		sample_clock.period = usec_elapsed(arrival, sample_clock.phase) * 1e6f;
+		sample_clock.n = sample_clock.period > 0.f ? 2 : 0;
+		sample_clock.phase = arrival;
+	}
+	else
+	{
+		sample_clock.n = 0;
+	}
+
+	if (sample_clock.n == 0)
+	{
+		sample_clock.phase = arrival;
+		sample_clock.phase_frac = 0.f;
+		sample_clock.var = 0.f;
+		sample_clock.bias = 0.f;
+		sample_clock.n = 1;
+	}
+	sample->sensor_time = sample_clock.phase;
+	sample->jitter = sqrtf(sample_clock.var);
+}
+#endif
+
+/*
+ * Makes a completely parsed and validated sample available to everything that
+ * consumes samples, except for ahrs_att_update(), which is done by offering
+ * the triple buffer after this.
+ */
+static void accept(struct ahrs_sample const *const sample)
+{
+	io_ahrs_seqlock_write_begin();
+	published = *sample;
+	io_ahrs_seqlock_write_end();
+#ifdef AHRS_QUEUE
+	queue_push(sample);
+#endif
+
+	for (uint_fast8_t i = 0; i < nhandlers; ++i)
+	{
+		handlers[i](sample);
+	}
+	for (uint_fast8_t i = 0; i < nsubscribers; ++i)
+	{
+		subscriber_add(&subscribers[i], sample);
+	}
+}
+
+#ifndef AVR
+/*
+ * Mounting rotation from the body frame to the frame of the ahrs, row major,
+ * ie the transpose of the attitude of the ahrs relative to the body frame
+ */
+static struct
+{
+	bool set;
+	float to_ahrs[9];
+} mount;
+
+/*
+ * Sets m to the rotation matrix, row major, of the Z-Y-X Euler angles att in
+ * degrees, per ahrs_att_rotation()
+ */
+static void euler_to_rotation(float const att[NUM_ATT_AXES], float m[9])
+{
+	float const rad = (float)M_PI / 180.f;
+	float s[NUM_ATT_AXES], c[NUM_ATT_AXES];
+	for (uint_fast8_t i = 0; i < NUM_ATT_AXES; ++i)
+	{
+		s[i] = sinf(att[i] * rad);
+		c[i] = cosf(att[i] * rad);
+	}
+	trig_to_rotation(s, c, m);
+}
+
+int ahrs_mount_set_euler(float const att[NUM_ATT_AXES])
+{
+	for (uint_fast8_t i = 0; i < NUM_ATT_AXES; ++i)
+	{
+		if (!isfinite(att[i]))
+		{
+			DEBUG("Mounting angle is infinite or NaN.");
+			return -1;
+		}
+	}
+	float m[9];
+	euler_to_rotation(att, m);
+	for (uint_fast8_t i = 0; i < 3; ++i)
+	{
+		for (uint_fast8_t j = 0; j < 3; ++j)
+		{
+			mount.to_ahrs[3 * i + j] = m[3 * j + i];
+		}
+	}
+	mount.set = true;
+	return 0;
+}
+
+int ahrs_mount_set_quaternion(float const q[4])
+{
+	float const norm2 = q[0] * q[0] + q[1] * q[1] + q[2] * q[2] + q[3] * q[3];
+	if (!isfinite(norm2) || !(norm2 > 0.f))
+	{
+		DEBUG("Mounting quaternion is zero, infinite or NaN.");
+		return -1;
+	}
+	// scaled by 2 / norm2, so an unnormalized q gives the same rotation
+	float const s = 2.f / norm2;
+	float const w = q[0], x = q[1], y = q[2], z = q[3];
+	// the transpose of the rotation q represents
+	float *const m = mount.to_ahrs;
+	m[0] = 1.f - s * (y * y + z * z);
+	m[1] = s * (x * y + w * z);
+	m[2] = s * (x * z - w * y);
+	m[3] = s * (x * y - w * z);
+	m[4] = 1.f - s * (x * x + z * z);
+	m[5] = s * (y * z + w * x);
+	m[6] = s * (x * z + w * y);
+	m[7] = s * (y * z - w * x);
+	m[8] = 1.f - s * (x * x + y * y);
+	mount.set = true;
+	return 0;
+}
+
+void ahrs_mount_clear()
+{
+	mount.set = false;
+}
+
+/*
+ * Rotates the attitude of the ahrs in sample, and its angular rates, into
+ * the body frame per mount.
+ */
+static void mount_apply(struct ahrs_sample *const sample)
+{
+	float const *const t = mount.to_ahrs;
+	float a[9]; // from the frame of the ahrs to north, east, down
+	euler_to_rotation(sample->att, a);
+	// Only the elements the angles are recovered from are needed of the
+	// rotation from the body frame to north, east, down, a * t.
+	float const b0 = a[0] * t[0] + a[1] * t[3] + a[2] * t[6];
+	float const b3 = a[3] * t[0] + a[4] * t[3] + a[5] * t[6];
+	float const b6 = a[6] * t[0] + a[7] * t[3] + a[8] * t[6];
+	float const b7 = a[6] * t[1] + a[7] * t[4] + a[8] * t[7];
+	float const b8 = a[6] * t[2] + a[7] * t[5] + a[8] * t[8];
+
+	float const deg = 180.f / (float)M_PI;
+	sample->att[PITCH] = -asinf(TRUNC(-1.f, b6, 1.f)) * deg;
+	sample->att[YAW] = wrap_deg(atan2f(b3, b0) * deg,
+			ahrs_range[YAW][COMPONENT_MIN]);
+	sample->att[ROLL] = atan2f(b7, b8) * deg;
+#ifdef AHRS_GYRO
+	// body rates are rotated by the transpose of t
+	float const *const g = sample->gyro;
+	float const gx = t[0] * g[GYRO_X] + t[3] * g[GYRO_Y] + t[6] * g[GYRO_Z];
+	float const gy = t[1] * g[GYRO_X] + t[4] * g[GYRO_Y] + t[7] * g[GYRO_Z];
+	float const gz = t[2] * g[GYRO_X] + t[5] * g[GYRO_Y] + t[8] * g[GYRO_Z];
+	sample->gyro[GYRO_X] = gx;
+	sample->gyro[GYRO_Y] = gy;
+	sample->gyro[GYRO_Z] = gz;
+#endif
+#ifdef AHRS_COMPACT
+	for (uint_fast8_t dir = 0; dir < NUM_ATT_AXES; ++dir)
+	{
+		sample->compact.att[dir] = ahrs_deg_to_bam(sample->att[dir]);
+	}
+#endif
+}
+#endif
+
+// when the byte being parsed was received
+static io_ahrs_usec recv_time;
+
+static io_ahrs_usec gap_max = AHRS_GAP_BYTES * BYTE_USEC;
+
+void ahrs_parse_gap_set(unsigned const nbytes)
+{
+	gap_max = (io_ahrs_usec)nbytes * BYTE_USEC;
+}
+
+static io_ahrs_usec stale_age;
+
+void ahrs_att_stale_set(io_ahrs_usec const max_age)
+{
+	stale_age = max_age;
+}
+
+io_ahrs_usec ahrs_att_age(io_ahrs_usec const now)
+{
+	return now - ahrs_att_time();
+}
+
+bool ahrs_att_stale(io_ahrs_usec const now)
+{
+	return stale_age && ahrs_att_age(now) > stale_age;
+}
+
+static struct ahrs_link_stats link_stats;
+
+void ahrs_link_stats(struct ahrs_link_stats *const stats)
+{
+	*stats = link_stats;
+}
+
+// ahrs_range in binary angle units
+static int_fast32_t const bam_range[NUM_ATT_AXES][2] = {
+	[PITCH] = {[COMPONENT_MIN] = -16384, [COMPONENT_MAX] = 16384},
+	[YAW] = {[COMPONENT_MIN] = 0, [COMPONENT_MAX] = 65536},
+	[ROLL] = {[COMPONENT_MIN] = -32768, [COMPONENT_MAX] = 32768}};
 
-static uint16_t const CRC_POST_ID_COUNT = 0x7982U; // crc of first 4 assumed byte values
+/*
+ * Converts an angle in degrees, given as the bits of an IEEE754 single, to
+ * binary angle units (AHRS_BAM_PER_REV per revolution, rounded to nearest)
+ * using only integer arithmetic, so no soft-float is needed on avr.
+ *
+ * returns false if the angle is not within ahrs_range[dir], including if it
+ * is infinite or NaN
+ */
+static bool angle_to_bam(uint32_t const bits, enum att_axis const dir,
+		uint16_t *const bam)
+{
+	bool const sign = bits >> 31;
+	uint_fast8_t const expon = bits >> 23 & 0xFFU;
+	uint_fast32_t mag; // magnitude in binary angle units
 
+	if (expon == 0xFFU) // infinity or NaN
+	{
+		return false;
+	}
+	else if (expon == 0x00U) // zero or subnormal, both far below 1 unit
+	{
+		mag = 0;
+	}
+	else
+	{
+		uint_fast32_t const significand = (bits & 0x7FFFFFUL) | 1UL << 23;
+		/* degrees = significand * 2^(expon - 127 - 23), so
+		 * units = significand * 2^(expon - 150) * 65536 / 360
+		 *       = significand * 2^(expon - 134) / 360
+		 *
+		 * Any angle in range is below 512 degrees, ie expon - 134 <= 1. The
+		 * division is done on significand * 2^7, which fits in 31 bits, so
+		 * that it keeps 7 - (expon - 134) >= 6 fractional bits for rounding.
+		 */
+		if (expon > 135)
+		{
+			return false;
+		}
+		uint_fast8_t const shift = 141 - expon;
+		uint_fast32_t const q = ((uint_fast32_t)significand << 7) / 360;
+		mag = shift >= 32 ? 0 : (q + (1UL << (shift - 1))) >> shift;
+	}
 
-float const ahrs_range[NUM_ATT_AXES][2] = {
-	[PITCH] = {[COMPONENT_MIN] = -90.f, [COMPONENT_MAX] = 90.f},
-	[YAW] = {[COMPONENT_MIN] = 0.f, [COMPONENT_MAX] = 360.f /* Should technically be the next lower float */},
-	[ROLL] = {[COMPONENT_MIN] = -180.f, [COMPONENT_MAX] = 180.f}};
+	int_fast32_t const units = sign ? -(int_fast32_t)mag : (int_fast32_t)mag;
+	if (!IN_RANGE(bam_range[dir][COMPONENT_MIN], units,
+				bam_range[dir][COMPONENT_MAX]))
+	{
+		return false;
+	}
+	*bam = (uint16_t)units; // modulo one revolution
+	return true;
+}
 
-// triple buffer coordinated with io_ahrs_tripbuf... functions
-static struct ahrs
+float ahrs_bam_to_deg(enum att_axis const dir, uint16_t const bam)
 {
-	float att[NUM_ATT_AXES];
-	uint_fast8_t headingstatus;
-} ahrs[3];
+	// heading is [0, 360), while pitch and roll are signed
+	float const units = dir == YAW ? (float)bam : (float)(int16_t)bam;
+	return units * (360.f / AHRS_BAM_PER_REV);
+}
 
+uint16_t ahrs_deg_to_bam(float const deg)
+{
+	// round to nearest, modulo one revolution
+	float const units = deg * (AHRS_BAM_PER_REV / 360.f);
+	return (uint16_t)(int_fast32_t)(units < 0 ? units - .5f : units + .5f);
+}
 
-float ahrs_att(enum att_axis const dir)
+void ahrs_compact_pack(struct ahrs_compact const *const compact,
+		unsigned char buf[AHRS_COMPACT_SIZE])
 {
-	return ahrs[io_ahrs_tripbuf_read()].att[dir];
+	for (uint_fast8_t i = 0; i < NUM_ATT_AXES; ++i)
+	{
+		buf[2 * i] = compact->att[i];
+		buf[2 * i + 1] = compact->att[i] >> 8;
+	}
+	buf[6] = compact->headingstatus;
+	buf[7] = compact->seq;
 }
 
-uint_fast8_t ahrs_headingstatus()
+void ahrs_compact_unpack(struct ahrs_compact *const compact,
+		unsigned char const buf[AHRS_COMPACT_SIZE])
 {
-	return ahrs[io_ahrs_tripbuf_read()].headingstatus;
+	for (uint_fast8_t i = 0; i < NUM_ATT_AXES; ++i)
+	{
+		compact->att[i] = buf[2 * i] | (uint16_t)buf[2 * i + 1] << 8;
+	}
+	compact->headingstatus = buf[6];
+	compact->seq = buf[7];
 }
 
-bool ahrs_att_update()
+#ifdef AHRS_COMPACT
+void ahrs_att_compact(struct ahrs_compact *const compact)
 {
-	return io_ahrs_tripbuf_update();
+	*compact = ahrs[io_ahrs_tripbuf_read()].compact;
 }
+#endif
 
 static enum
 {
@@ -92,6 +1048,9 @@ static enum
  */
 static bool parse_att(unsigned char const c)
 {
+#ifdef AHRS_CLOCK
+	sample_clock.nbytes += sample_clock.nbytes != UINT_FAST16_MAX;
+#endif
 	switch (state)
 	{
 		case INIT:;
@@ -135,15 +1094,22 @@ static bool parse_att(unsigned char const c)
 		// no need to compute the crc of the first four bytes at runtime, since
 		// their values are already assumed
 		crc = CRC_POST_ID_COUNT;
+		TRACE(TRACE_SYNC);
+		++link_stats.synced;
 
 		// Just get the triple buffer write index once, since it can't
 		// change until io_ahrs_tripbuf_offer is invoked.
 		static unsigned char write_idx;
 		write_idx = io_ahrs_tripbuf_write();
 
+		ahrs[write_idx].time = recv_time;
+		derived[write_idx].valid = 0;
+
 		static struct cir
 		{
-			unsigned char att           : 3; // Bit positions PITCH, YAW, ROLL
+			// Bit positions PITCH, YAW, ROLL, then NUM_ATT_AXES + GYRO_X,
+			// GYRO_Y, GYRO_Z
+			unsigned char flt           : 6;
 			unsigned char headingstatus : 1;
 		} comp_is_read;
 		comp_is_read = (struct cir){0, 0};
@@ -154,26 +1120,39 @@ static bool parse_att(unsigned char const c)
 			return false;
 		case COMPONENT_ID:;
 
+			// bit position of the component in comp_is_read.flt
 			static uint_fast8_t dir;
+			// where the float value of the component is stored
+			static float *val;
 			// data components may arrive in arbitrary order
 			if (c == 5) // kHeading component
 			{
 				dir = YAW;
+				val = &ahrs[write_idx].att[YAW];
 			}
 			else if (c == 24) // kPitch component
 			{
 				dir = PITCH;
+				val = &ahrs[write_idx].att[PITCH];
 			}
 			else if (c == 25) // kRoll component
 			{
 				dir = ROLL;
+				val = &ahrs[write_idx].att[ROLL];
+			}
+#ifdef AHRS_GYRO
+			else if (IN_RANGE(74, c, 76)) // kGyroX, kGyroY, kGyroZ components
+			{
+				dir = NUM_ATT_AXES + GYRO_X + (c - 74);
+				val = &ahrs[write_idx].gyro[GYRO_X + (c - 74)];
 			}
+#endif
 			else if (c == 79) // kHeadingStatus component
 			{
 				if (comp_is_read.headingstatus)
 				{
 					// repeat component, fail datagram
-					DEBUG("Repead component.");
+					DLOG("Repead component.");
 					state = INIT;
 					return false;
 				}
@@ -186,24 +1165,30 @@ static bool parse_att(unsigned char const c)
 		case HEADINGSTATUS:;
 
 				ahrs[write_idx].headingstatus = c;
+#ifdef AHRS_COMPACT
+				ahrs[write_idx].compact.headingstatus = c;
+#endif
 				continue;
 			}
 			else // unrecognized component type
 			{
 				// fail datagram
-				DEBUG("Unrecognized component.");
+				DLOG("Unrecognized component.");
 				state = INIT;
 				return false;
 			}
 
-			if (comp_is_read.att & (1U << dir))
+			if (comp_is_read.flt & (1U << dir))
 			{
 				// component is a repeat, fail datagram
-				DEBUG("Repeat component.");
+				DLOG("Repeat component.");
 				state = INIT;
 				return false;
 			}
 
+			// raw IEEE754 bits of the value, for range checking
+			static uint32_t bits;
+
 /* There doesn't seem to be any compiler-defined macros to check for IEEE754
  * format floats. GCC never defines __STD_IEC_559__, since it doesn't conform.
  * avr-gcc uses IEEE754 format little endian floats.
@@ -227,8 +1212,9 @@ static bool parse_att(unsigned char const c)
 					// while native floats are assumed to be little endian.
 					//
 					// type-pun float in order to write raw bytes
-					((unsigned char *)&ahrs[write_idx].att[dir])[j] = c;
+					((unsigned char *)val)[j] = c;
 				}
+				memcpy(&bits, val, sizeof(bits));
 			}
 #else // translate floating point data to native format portably
 
@@ -261,7 +1247,7 @@ static bool parse_att(unsigned char const c)
 				expon |= (uint8_t)c >> 7;
 				if (expon == 0xFFU)
 				{
-					DEBUG("Infinity or NaN received.");
+					DLOG("Infinity or NaN received.");
 					// float must be +\- infinity or NaN, fail datagram
 					state = INIT;
 					return false;
@@ -285,58 +1271,72 @@ static bool parse_att(unsigned char const c)
 		case ANGLE_BYTE3:;
 
 				mantissa |= c;
+				bits = (uint32_t)sign << 31 | (uint32_t)expon << 23 | mantissa;
 				// All the float data has been received
 				if (expon == 0x00U)
 				{
 					if (mantissa != 0)
 					{
-						DEBUG("Subnormal number received.");
+						DLOG("Subnormal number received.");
 						// subnormal number, fail datagram
 						state = INIT;
 						return false;
 					}
 					// float is +/- 0
-					ahrs[write_idx].att[dir] = 0.f;
+					*val = 0.f;
 				}
 				else
 				{
 					// float is a normalized value
-					ahrs[write_idx].att[dir] = mantissa;
+					*val = mantissa;
 					// The significand is 1.mantissa, so the exponent needs to
 					// be decreased by the number of mantissa bits. expon also
 					// has a bias (0 offset) of 127.
 					int power = expon - 23 - 127;
-					ahrs[write_idx].att[dir] *= exp2f(power);
+					*val *= exp2f(power);
 					if (sign)
 					{
-						ahrs[write_idx].att[dir] *= -1;
+						*val *= -1;
 					}
 				}
 			}
 #endif
-			/* TODO: Check and scale angle values
-			 * They come from the ahrs in this range:
-			 * heading: 0.0 - 359.9
-			 * pitch: -90 - 90
-			 * roll: -180 - 180
-
-			// kHeading, kPitch, and kRoll, all give a value in a 4 byte/32
-			// bit format, in degrees, in the range [0, 360).
-			if (ahrs[write_idx].att[dir] < 0.f ||
-					360.f <= ahrs[write_idx].att[dir])
+			if (dir < NUM_ATT_AXES)
+			{
+				uint16_t bam;
+				if (!angle_to_bam(bits, dir, &bam))
+				{
+					DLOG("Angle outside of ahrs_range.");
+					// fail datagram
+					state = INIT;
+					return false;
+				}
+#ifdef AHRS_COMPACT
+				ahrs[write_idx].compact.att[dir] = bam;
+#else
+				(void)bam;
+#endif
+			}
+#ifdef AHRS_GYRO
+			else if ((bits >> 23 & 0xFFU) >= 127U + AHRS_GYRO_MAX_EXP)
 			{
-				// received attitude value outside of the expected range
+				DLOG("Angular rate infinite, NaN or out of range.");
+				// fail datagram
 				state = INIT;
 				return false;
 			}
-			ahrs[write_idx].att[dir] \= 360.f; // scale to be from 0.0 - 1.0
-			*/
+#endif
 
-			comp_is_read.att |= 1U << dir; // valid value has been read for this dir
+			comp_is_read.flt |= 1U << dir; // valid value has been read for this dir
 		}
-		if (!~comp_is_read.att || !comp_is_read.headingstatus)
+#ifdef AHRS_GYRO
+		if (comp_is_read.flt != (1U << (NUM_ATT_AXES + NUM_GYRO_AXES)) - 1 ||
+#else
+		if (comp_is_read.flt != (1U << NUM_ATT_AXES) - 1 ||
+#endif
+				!comp_is_read.headingstatus)
 		{
-			DEBUG("Not all data components received.");
+			DLOG("Not all data components received.");
 			// fail datagram
 			state = INIT;
 			return false;
@@ -357,6 +1357,22 @@ static bool parse_att(unsigned char const c)
 		// if the crc of the entire datagram == 0.
 		if (crc_xmodem_update(crc, c) == 0x0000)
 		{
+			TRACE(TRACE_CRC);
+#ifndef AVR
+			if (mount.set)
+			{
+				mount_apply(&ahrs[write_idx]);
+			}
+#endif
+#ifdef AHRS_COMPACT
+			static uint8_t seq;
+			ahrs[write_idx].compact.seq = seq++;
+#endif
+#ifdef AHRS_CLOCK
+			clock_update(&ahrs[write_idx]);
+#endif
+			++link_stats.accepted;
+			accept(&ahrs[write_idx]);
 			io_ahrs_tripbuf_offer();
 			// Datagram and all attitude data is considered valid
 			state = INIT;
@@ -365,7 +1381,7 @@ static bool parse_att(unsigned char const c)
 		else
 		{
 			// Invalid crc, attitude data will be discarded
-			DEBUG("Invalid CRC: %04X", crc_xmodem_update(crc, c));
+			DLOG("Invalid CRC: %04lX", crc_xmodem_update(crc, c));
 			state = INIT;
 			return false;
 		}
@@ -383,19 +1399,59 @@ static bool parse_att(unsigned char const c)
 void ahrs_parse_att_reset()
 {
 	state = INIT;
+#ifdef AHRS_CLOCK
+	// eg while commands were exchanged
+	sample_clock.nbytes = UINT_FAST16_MAX;
+#endif
 	return;
 }
 
+/*
+ * Notes the arrival of data received at now before it is parsed, resetting
+ * the parser if there was too long a gap within a datagram.
+ */
+static void recv_chunk(io_ahrs_usec const now)
+{
+	TRACE(TRACE_CHUNK);
+	if (gap_max && state != INIT && now - recv_time > gap_max)
+	{
+		// The rest of the datagram was lost, eg due to a cable glitch, so
+		// don't let it merge with the next one.
+		DLOG("Intra-datagram gap of %lu us, resetting parser.",
+				now - recv_time);
+		state = INIT;
+	}
+	recv_time = now;
+}
+
 int ahrs_att_recv()
 {
+	// The rest of a chunk was received at the same time as its first byte,
+	// so the clock is only read once per chunk.
+	bool chunk;
 	int c;
-	if ((c = getc(io_ahrs)) == EOF)
+	if ((c = io_ahrs_getc_chunk(&chunk)) == EOF)
 	{
 		return EOF;
 	}
+	if (chunk)
+	{
+		recv_chunk(io_ahrs_time());
+	}
 	return parse_att(c);
 }
 
+size_t ahrs_att_feed(unsigned char const *const data, size_t const n)
+{
+	recv_chunk(io_ahrs_time());
+	size_t nparsed = 0;
+	for (size_t i = 0; i < n; ++i)
+	{
+		nparsed += parse_att(data[i]);
+	}
+	return nparsed;
+}
+
 /**
  * writes n bytes from data to io_ahrs, or until error or EOF
  *
@@ -410,15 +1466,238 @@ static size_t ahrs_write_raw(void const * const datagram, size_t const n)
 	return nwrit;
 }
 
+/*
+ * returns the bits of f as an IEEE754 single
+ */
+static uint32_t float_to_bits(float const f)
+{
+#ifdef IEEE754
+	uint32_t bits;
+	memcpy(&bits, &f, sizeof(bits));
+	return bits;
+#else
+	if (f == 0.f)
+	{
+		return 0;
+	}
+	// Only normalized values are handled, which is all that is ever sent
+	int expon;
+	float const frac = frexpf(fabsf(f), &expon); // in [0.5, 1)
+	uint32_t const mantissa = (uint32_t)ldexpf(frac, 24) & 0x7FFFFFUL;
+	return (uint32_t)(f < 0.f) << 31 | (uint32_t)(expon - 1 + 127) << 23 |
+		mantissa;
+#endif
+}
+
+/*
+ * returns the IEEE754 single with the passed bits as a native float
+ */
+static float bits_to_float(uint32_t const bits)
+{
+#ifdef IEEE754
+	float f;
+	memcpy(&f, &bits, sizeof(f));
+	return f;
+#else
+	uint_fast8_t const expon = bits >> 23 & 0xFFU;
+	if (expon == 0x00U)
+	{
+		return 0.f; // subnormals are taken as zero
+	}
+	float const f = ldexpf((bits & 0x7FFFFFUL) | 1UL << 23, expon - 150);
+	return bits >> 31 ? -f : f;
+#endif
+}
+
+static void put_be32(unsigned char *const buf, uint32_t const val)
+{
+	buf[0] = val >> 24;
+	buf[1] = val >> 16;
+	buf[2] = val >> 8;
+	buf[3] = val;
+}
+
+static uint32_t get_be32(unsigned char const *const buf)
+{
+	return (uint32_t)buf[0] << 24 | (uint32_t)buf[1] << 16 |
+		(uint32_t)buf[2] << 8 | buf[3];
+}
+
+/**
+ * Creates a datagram from the packet frame of n bytes (Frame ID followed by
+ * its payload) by prepending the byte count and appending the crc, and writes
+ * it to io_ahrs.
+ *
+ * returns 0 on success
+ */
+static int ahrs_write_frame(unsigned char const *const frame, size_t const n)
+{
+	unsigned char datagram[AHRS_FRAME_MAX];
+	assert(n + 4 <= sizeof(datagram));
+	datagram[0] = (n + 4) >> 8;
+	datagram[1] = n + 4;
+	memcpy(datagram + 2, frame, n);
+	uint16_t crc = CRC_XMODEM_INIT_VAL;
+	for (size_t i = 0; i < n + 2; ++i)
+	{
+		crc = crc_xmodem_update(crc, datagram[i]);
+	}
+	datagram[n + 2] = crc >> 8;
+	datagram[n + 3] = crc;
+	return ahrs_write_raw(datagram, n + 4) == n + 4 ? 0 : -1;
+}
+
+/**
+ * Reads datagrams from io_ahrs until one with Frame ID id and min to max bytes
+ * of payload passes its crc, and copies its payload to payload. Anything else
+ * received, eg kGetDataResp datagrams in continuous mode, is skipped.
+ *
+ * Must not be used while the receive handler is running, since it would
+ * consume bytes the handler expects.
+ *
+ * returns the number of bytes of payload, or -1 if no such datagram arrived
+ * within timeout
+ */
+static int ahrs_read_datagram(unsigned char const id,
+		unsigned char *const payload, size_t const min, size_t const max,
+		io_ahrs_usec const timeout)
+{
+	// 2 Byte Count + 1 Frame ID + payload + 2 CRC
+	assert(max + 5 <= AHRS_FRAME_MAX);
+	unsigned char buf[AHRS_FRAME_MAX];
+	size_t have = 0;
+
+	io_ahrs_usec const start = io_ahrs_time();
+	for (;;)
+	{
+		io_ahrs_usec const elapsed = io_ahrs_time() - start;
+		if (elapsed >= timeout)
+		{
+			return -1;
+		}
+		int const c = io_ahrs_getc_timeout(timeout - elapsed);
+		if (c == EOF)
+		{
+			return -1;
+		}
+		buf[have++] = c;
+
+		// Slide along the received bytes until they start with a valid
+		// datagram of an expected length and id, or there are too few to
+		// tell yet.
+		while (have >= 2)
+		{
+			size_t const len = (size_t)buf[0] << 8 | buf[1];
+			if (len < min + 5 || len > max + 5 || (have >= 3 && buf[2] != id))
+			{
+				memmove(buf, buf + 1, --have);
+				continue;
+			}
+			if (have < len)
+			{
+				break;
+			}
+			uint16_t crc = CRC_XMODEM_INIT_VAL;
+			for (size_t i = 0; i < len; ++i)
+			{
+				crc = crc_xmodem_update(crc, buf[i]);
+			}
+			if (crc == 0x0000)
+			{
+				if (len > 5)
+				{
+					memcpy(payload, buf + 3, len - 5);
+				}
+				return len - 5;
+			}
+			memmove(buf, buf + 1, --have);
+		}
+	}
+}
+
+/**
+ * Like ahrs_read_datagram(), for exactly n bytes of payload.
+ *
+ * returns 0 on success, or -1 if no such datagram arrived within timeout
+ */
+static int ahrs_read_frame(unsigned char const id, unsigned char *const payload,
+		size_t const n, io_ahrs_usec const timeout)
+{
+	return ahrs_read_datagram(id, payload, n, n, timeout) < 0 ? -1 : 0;
+}
+
+int ahrs_set_acq_params(struct ahrs_acq_params const *const params)
+{
+	unsigned char frame[] = {
+			24, // Frame ID: kSetAcqParams
+			params->polled, // Acquisition Mode
+			params->flush_filter, // Flush Filter
+			0, 0, 0, 0, // PNI reserved float32, must be 0
+			0, 0, 0, 0}; // Sample Delay float32, filled in below
+	put_be32(frame + 7, float_to_bits(params->sample_delay));
+
+	if (ahrs_write_frame(frame, sizeof(frame)))
+	{
+		DEBUG("Failed sending kSetAcqParams command.");
+		return -1;
+	}
+	// kSetAcqParamsDone has no payload
+	if (ahrs_read_frame(26, NULL, 0, AHRS_RESPONSE_USEC))
+	{
+		DEBUG("No kSetAcqParamsDone response.");
+		return -1;
+	}
+	return 0;
+}
+
+int ahrs_get_acq_params(struct ahrs_acq_params *const params)
+{
+	static unsigned char const frame[] = {25}; // Frame ID: kGetAcqParams
+	if (ahrs_write_frame(frame, sizeof(frame)))
+	{
+		DEBUG("Failed sending kGetAcqParams command.");
+		return -1;
+	}
+
+	// kGetAcqParamsResp, with the same payload as kSetAcqParams
+	unsigned char payload[10];
+	if (ahrs_read_frame(27, payload, sizeof(payload), AHRS_RESPONSE_USEC))
+	{
+		DEBUG("No kGetAcqParamsResp response.");
+		return -1;
+	}
+	params->polled = payload[0];
+	params->flush_filter = payload[1];
+	params->sample_delay = bits_to_float(get_be32(payload + 6));
+	return 0;
+}
+
+float ahrs_min_sample_interval(unsigned long const baud)
+{
+	// each byte takes 1 start bit + 8 data bits + 1 stop bit
+	return DATAGRAM_BYTECOUNT * 10.f / baud;
+}
+
 int ahrs_set_datacomp()
 {
-	/* Data components must be set at least each time the ahrs is powered. At
-	 * least AFAIK, there isn't a way to set this persistently.
+	/* Data components must be set each time the ahrs is powered, unless
+	 * they were persisted with ahrs_save(). ahrs_start() only calls this
+	 * when they don't already match.
 	 *
 	 * Datagram to set data components to:
-	 * kHeading, kPitch, kRoll
+	 * kHeading, kPitch, kRoll, kHeadingStatus (and kGyroX, kGyroY, kGyroZ)
 	 * parse_att() allows them to be in any order
 	 */
+#ifdef AHRS_GYRO
+	static unsigned char const datagram_set_comp[] = {
+			0x00, 0x0D, // bytecount
+			0x03, // Frame ID: kSetDataComponents
+			0x07, // ID Count
+			// Component IDs: kHeading, kPitch, kRoll, kHeadingStatus, kGyroX,
+			// kGyroY, kGyroZ respectively
+			5, 24, 25, 79, 74, 75, 76,
+			0x98, 0x40}; // crc
+#else
 	static unsigned char const datagram_set_comp[] = {
 			0x00, 0x0A, // bytecount
 			0x03, // Frame ID: kSetDataComponents
@@ -426,6 +1705,7 @@ int ahrs_set_datacomp()
 			// Component IDs: kHeading, kPitch, kRoll, kHeadingStatus respectively
 			5, 24, 25, 79,
 			0xE2, 0xEF}; // crc
+#endif
 	if (ahrs_write_raw(datagram_set_comp, sizeof(datagram_set_comp)) !=
 			sizeof(datagram_set_comp))
 	{
@@ -450,3 +1730,173 @@ int ahrs_cont_start()
 	}
 	return 0;
 }
+
+int ahrs_save()
+{
+	static unsigned char const frame[] = {9}; // Frame ID: kSave
+	if (ahrs_write_frame(frame, sizeof(frame)))
+	{
+		DEBUG("Failed sending kSave command.");
+		return -1;
+	}
+	// kSaveDone, with a UInt16 error code
+	unsigned char payload[2];
+	if (ahrs_read_frame(16, payload, sizeof(payload), AHRS_RESPONSE_USEC))
+	{
+		DEBUG("No kSaveDone response.");
+		return -1;
+	}
+	if (payload[0] || payload[1])
+	{
+		DEBUG("kSave failed with error code %u.",
+				(unsigned)payload[0] << 8 | payload[1]);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * returns true if the payload of a kGetDataResp has exactly the data
+ * components parse_att() expects, in any order
+ */
+static bool datacomp_match(unsigned char const *const payload, size_t const n)
+{
+	static unsigned char const ids[] = {5, 24, 25, 79
+#ifdef AHRS_GYRO
+		, 74, 75, 76
+#endif
+	};
+	if (!n || payload[0] != ID_COUNT)
+	{
+		return false;
+	}
+	uint_fast8_t seen = 0; // bit positions are indices into ids
+	size_t i = 1;
+	for (uint_fast8_t k = ID_COUNT; k--;)
+	{
+		if (i >= n)
+		{
+			return false;
+		}
+		uint_fast8_t j = 0;
+		while (j < COUNTOF(ids) && ids[j] != payload[i])
+		{
+			++j;
+		}
+		if (j == COUNTOF(ids) || seen & 1U << j)
+		{
+			return false;
+		}
+		seen |= 1U << j;
+		// kHeadingStatus is a UInt8, the rest are float32
+		i += payload[i] == 79 ? 2 : 5;
+	}
+	return i == n;
+}
+
+/*
+ * returns the time left of timeout since start, at most max, or 0 if none
+ */
+static io_ahrs_usec time_left(io_ahrs_usec const start,
+		io_ahrs_usec const timeout, io_ahrs_usec const max)
+{
+	io_ahrs_usec const elapsed = io_ahrs_time() - start;
+	if (elapsed >= timeout)
+	{
+		return 0;
+	}
+	return timeout - elapsed < max ? timeout - elapsed : max;
+}
+
+int ahrs_start(io_ahrs_usec const timeout, bool const save)
+{
+	io_ahrs_usec const start = io_ahrs_time();
+	io_ahrs_usec left;
+
+	// The ahrs ignores commands until it has booted, so probe until it
+	// answers rather than waiting for as long as booting could take.
+	static unsigned char const get_mod_info[] = {1}; // Frame ID: kGetModInfo
+	// kGetModInfoResp, with the module type and firmware revision
+	unsigned char mod_info[8];
+	do
+	{
+		if (!(left = time_left(start, timeout, AHRS_PROBE_USEC)))
+		{
+			DEBUG("No kGetModInfoResp response.");
+			return -1;
+		}
+		if (ahrs_write_frame(get_mod_info, sizeof(get_mod_info)))
+		{
+			DEBUG("Failed sending kGetModInfo command.");
+			return -1;
+		}
+	} while (ahrs_read_frame(2, mod_info, sizeof(mod_info), left));
+
+	// There is no command to read back the data components, so check those
+	// of a data set requested with kGetData instead. In continuous mode, one
+	// already being sent will do just as well.
+	static unsigned char const get_data[] = {4}; // Frame ID: kGetData
+	if (ahrs_write_frame(get_data, sizeof(get_data)))
+	{
+		DEBUG("Failed sending kGetData command.");
+		return -1;
+	}
+	unsigned char payload[AHRS_FRAME_MAX - 5];
+	int const n = ahrs_read_datagram(FRAME_ID, payload, 1, sizeof(payload),
+			time_left(start, timeout, AHRS_RESPONSE_USEC));
+	bool const match = n > 0 && datacomp_match(payload, n);
+	if (!match && (ahrs_set_datacomp() || (save && ahrs_save())))
+	{
+		return -1;
+	}
+	if (ahrs_cont_start())
+	{
+		return -1;
+	}
+
+	ahrs_parse_att_reset();
+	if (match)
+	{
+		// That data set is already valid, so parse it rather than waiting
+		// for the next.
+		unsigned char datagram[AHRS_FRAME_MAX];
+		datagram[0] = DATAGRAM_BYTECOUNT >> 8;
+		datagram[1] = DATAGRAM_BYTECOUNT;
+		datagram[2] = FRAME_ID;
+		memcpy(datagram + 3, payload, n);
+		uint16_t crc = CRC_XMODEM_INIT_VAL;
+		for (int i = 0; i < n + 3; ++i)
+		{
+			crc = crc_xmodem_update(crc, datagram[i]);
+		}
+		datagram[n + 3] = crc >> 8;
+		datagram[n + 4] = crc;
+		if (ahrs_att_feed(datagram, n + 5))
+		{
+			return 0;
+		}
+	}
+
+	// Wait for the first data set in continuous mode, which also leaves the
+	// parser in sync for the receive handler.
+	while ((left = time_left(start, timeout, timeout)))
+	{
+		int const c = io_ahrs_getc_timeout(left);
+		if (c == EOF)
+		{
+			break;
+		}
+		recv_chunk(io_ahrs_time());
+		if (parse_att(c))
+		{
+			return 0;
+		}
+	}
+	DEBUG("No kGetDataResp data set.");
+	return -1;
+}
+
+int ahrs_reconnect()
+{
+	return ahrs_start(AHRS_RECONNECT_USEC, false);
+}
@@ -6,14 +6,90 @@ extern "C" {
 #endif
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "io_ahrs.h"
 
 
 enum {COMPONENT_MIN, COMPONENT_MAX};
 
 enum att_axis {PITCH, YAW, ROLL, NUM_ATT_AXES};
 
+/*
+ * Sensor frame axes of the kGyroX/Y/Z components: x forward, y right, z down.
+ * Only received when compiled with AHRS_GYRO defined.
+ */
+enum gyro_axis {GYRO_X, GYRO_Y, GYRO_Z, NUM_GYRO_AXES};
+
 extern float const ahrs_range[NUM_ATT_AXES][2];
 
+// Binary angle units per revolution, as used by struct ahrs_compact
+#define AHRS_BAM_PER_REV 65536UL
+
+// Size of a struct ahrs_compact packed by ahrs_compact_pack()
+#define AHRS_COMPACT_SIZE 8U
+
+/*
+ * Compact fixed point form of an attitude data set, for logging, ipc, and
+ * consumers without an fpu. Angles are in binary angle units, ie modulo
+ * AHRS_BAM_PER_REV per revolution; convert with ahrs_bam_to_deg(). seq is
+ * the low 8 bits of a count of data sets, to detect dropped ones.
+ */
+struct ahrs_compact
+{
+	uint16_t att[NUM_ATT_AXES]; // indexed by enum att_axis
+	uint8_t headingstatus;
+	uint8_t seq;
+};
+
+/*
+ * One complete set of data received from the ahrs.
+ */
+struct ahrs_sample
+{
+	float att[NUM_ATT_AXES]; // indexed by enum att_axis, per ahrs_att()
+	uint_fast8_t headingstatus; // per ahrs_headingstatus()
+	io_ahrs_usec time; // per ahrs_att_time()
+#ifdef AHRS_GYRO
+	float gyro[NUM_GYRO_AXES]; // per ahrs_gyro()
+#endif
+#ifdef AHRS_COMPACT
+	struct ahrs_compact compact; // per ahrs_att_compact()
+#endif
+#ifdef AHRS_CLOCK
+	io_ahrs_usec sensor_time; // per ahrs_att_sensor_time()
+	float jitter; // per ahrs_att_jitter()
+#endif
+};
+
+/**
+ * returns the angle in binary angle units converted to degrees, in the range
+ * of ahrs_range[dir] (except that the maximum of pitch and roll wraps to the
+ * minimum).
+ */
+float ahrs_bam_to_deg(enum att_axis dir, uint16_t bam);
+
+/**
+ * returns the angle in degrees converted to binary angle units, modulo one
+ * revolution.
+ */
+uint16_t ahrs_deg_to_bam(float deg);
+
+/**
+ * Serializes compact to exactly AHRS_COMPACT_SIZE bytes in buf, independent
+ * of platform: the angles as little endian 16 bit values in enum att_axis
+ * order, then headingstatus, then seq.
+ */
+void ahrs_compact_pack(struct ahrs_compact const *compact,
+		unsigned char buf[AHRS_COMPACT_SIZE]);
+
+/**
+ * Deserializes compact from buf, as written by ahrs_compact_pack().
+ */
+void ahrs_compact_unpack(struct ahrs_compact *compact,
+		unsigned char const buf[AHRS_COMPACT_SIZE]);
+
 /**
  * Tells ahrs to start sending data in continous mode.
  *
@@ -43,6 +119,144 @@ float ahrs_att(enum att_axis dir);
  */
 uint_fast8_t ahrs_headingstatus();
 
+#ifdef AHRS_COMPACT
+/**
+ * Copies the current attitude data to compact, as converted while it was
+ * parsed (with integer arithmetic only), when compiled with AHRS_COMPACT
+ * defined. It changes along with ahrs_att().
+ */
+void ahrs_att_compact(struct ahrs_compact *compact);
+#endif
+
+/**
+ * returns the time at which the current attitude data was received, per
+ * io_ahrs_time(). Specifically, this is when the header of its datagram was
+ * received, so it excludes the time taken to transmit and parse the rest of
+ * the datagram.
+ */
+io_ahrs_usec ahrs_att_time();
+
+#ifdef AHRS_CLOCK
+/**
+ * returns the time at which the current attitude data was sampled, on the
+ * timebase of io_ahrs_time(), when compiled with AHRS_CLOCK defined.
+ *
+ * The ahrs samples at a steady interval in Continuous Mode, but the times
+ * its datagrams arrive, per ahrs_att_time(), are delayed by varying amounts
+ * by eg usb serial adapters and kernel buffering. This is the arrival time
+ * with that jitter filtered out, by fitting the sample interval and phase to
+ * the arrival times of the last AHRS_CLOCK_MEMORY or so data sets. It lags
+ * the true sample time by about the mean delay, which is constant.
+ *
+ * Data sets are assumed to be sampled one interval apart unless bytes were
+ * discarded between them, or ahrs_parse_att_reset() was called. The fit
+ * restarts, equalling ahrs_att_time() for the first data set, when the
+ * sample interval changes, when data sets are lost before it has settled,
+ * and after a gap of more than AHRS_CLOCK_MAX_SKIP sample intervals.
+ */
+io_ahrs_usec ahrs_att_sensor_time();
+
+/**
+ * returns the rms difference between the arrival times and sensor times of
+ * recent attitude data, per ahrs_att_sensor_time(), in us
+ */
+float ahrs_att_jitter();
+#endif
+
+#ifdef AHRS_GYRO
+/**
+ * returns the angular rate about the passed sensor axis in rad/s, as received
+ * with the current attitude data. Data sets with a rate that is infinite,
+ * NaN, or 2^AHRS_GYRO_MAX_EXP (default 7) rad/s or more are rejected.
+ */
+float ahrs_gyro(enum gyro_axis axis);
+
+/**
+ * Extrapolates the current attitude data to the time now (per io_ahrs_time())
+ * using the angular rates received with it, and writes the result to att,
+ * indexed by enum att_axis and in the same ranges as ahrs_att().
+ *
+ * The angular rates are assumed constant over the extrapolation interval, so
+ * the interval is limited to AHRS_PREDICT_MAX_USEC. A now before the attitude
+ * data was received extrapolates backwards.
+ */
+void ahrs_att_predicted(io_ahrs_usec now, float att[NUM_ATT_AXES]);
+#endif
+
+/*
+ * Quantities derived from the current attitude data, in the x forward, y
+ * right, z down body frame and the north, east, down frame. Each is computed
+ * the first time it is asked for after ahrs_att_update() makes new data
+ * current, and reused until then, so any number of consumers can use them
+ * for the cost of one. Like ahrs_att(), they must only be called from the
+ * thread calling ahrs_att_update(), and the returned arrays are only valid
+ * until it is next called.
+ */
+
+/**
+ * returns the 3x3 rotation matrix, row major, from the body frame to the
+ * north, east, down frame
+ */
+float const *ahrs_att_rotation();
+
+/**
+ * returns the unit quaternion (w, x, y, z) of the same rotation as
+ * ahrs_att_rotation()
+ */
+float const *ahrs_att_quaternion();
+
+/**
+ * returns the unit vector in the body frame pointing down, ie the direction
+ * of gravity
+ */
+float const *ahrs_att_gravity();
+
+/**
+ * returns the heading in degrees, unwrapped so that it changes continuously
+ * across north instead of wrapping between 360 and 0. Assumes it changes by
+ * less than 180 degrees between the data it is asked for.
+ */
+float ahrs_att_heading_unwrapped();
+
+#ifndef AVR
+/*
+ * Mounting alignment, for an ahrs mounted rotated relative to the x forward,
+ * y right, z down body frame of the vehicle. Once set, parse_att() rotates
+ * every data set into the body frame as it is accepted, so that ahrs_att()
+ * and everything else that reports attitude (and angular rates, with
+ * AHRS_GYRO) reports that of the vehicle rather than that of the ahrs. Like
+ * the commands, these must not be called while the receive handler is
+ * running.
+ *
+ * Not available on avr, where parse_att() runs in the receive interrupt and
+ * the software floating point trig would hold it off for milliseconds per
+ * data set. Apply the rotation to ahrs_att_rotation() from the main loop
+ * instead.
+ */
+
+/**
+ * Sets the mounting rotation to the attitude of the ahrs relative to the
+ * body frame, in degrees, in the same convention as ahrs_att().
+ *
+ * returns 0 on success, or -1 if an angle is infinite or NaN
+ */
+int ahrs_mount_set_euler(float const att[NUM_ATT_AXES]);
+
+/**
+ * Sets the mounting rotation to the quaternion (w, x, y, z) of the rotation
+ * from the frame of the ahrs to the body frame, in the same sense as
+ * ahrs_att_quaternion(). It need not be normalized.
+ *
+ * returns 0 on success, or -1 if it is zero, infinite or NaN
+ */
+int ahrs_mount_set_quaternion(float const q[4]);
+
+/**
+ * Removes the mounting rotation, so data sets are reported as received.
+ */
+void ahrs_mount_clear();
+#endif
+
 /**
  * Updates the values returned by ahrs_att to the newest complete set
  * of data that has been received from the ahrs before some point in time
@@ -56,6 +270,98 @@ uint_fast8_t ahrs_headingstatus();
  */
 bool ahrs_att_update();
 
+/**
+ * Copies the newest complete set of data received from the ahrs to sample.
+ *
+ * Unlike ahrs_att() and friends, which are for a single consumer, this may be
+ * called from any number of threads concurrently without any coordination
+ * with each other or with the receiving of data. It never holds up the
+ * writer. It is lock free rather than wait free, though: it spins while a
+ * new set of data is being published, which is a copy of a few dozen bytes,
+ * and retries the copy if one is published during it. A reader preempted
+ * by the receive thread, or running at a higher priority than it, may
+ * therefore spin for as long as the receive thread isn't scheduled.
+ *
+ * returns the generation of the copied data: the number of complete sets of
+ * data received so far, so 0 if none has been received yet. A reader can
+ * compare generations to tell whether it has seen the data before. On avr the
+ * generation wraps at 128.
+ */
+unsigned long ahrs_att_snapshot(struct ahrs_sample *sample);
+
+/**
+ * Registers handler to be called with each complete set of data received from
+ * the ahrs, before it is made available to ahrs_att_update(). handler is
+ * called from whatever receives the data, ie the receive thread, or the
+ * Receive Complete Interrupt on avr, so it should return quickly.
+ *
+ * Handlers should be added before io_ahrs_recv_start() is called. At most
+ * AHRS_NHANDLERS may be added.
+ *
+ * returns 0 on success
+ */
+int ahrs_sample_handler_add(void (*handler)(struct ahrs_sample const *));
+
+/*
+ * How ahrs_subscribe() reduces the data sets received over each interval to
+ * the one delivered
+ */
+enum ahrs_reduce
+{
+	AHRS_REDUCE_LATEST, // the last one received
+	AHRS_REDUCE_BOXCAR, // the mean of each value
+	// Like AHRS_REDUCE_BOXCAR, but heading and roll are averaged across
+	// their wrap point, eg the mean of 359 and 1 degrees is 0 rather than
+	// 180. Assumes they vary by less than 180 degrees over an interval.
+	AHRS_REDUCE_ANGULAR
+};
+
+/**
+ * Registers handler to be called with one data set per interval (in the
+ * units of io_ahrs_time()), reduced from those received over the interval,
+ * so that consumers wanting less than the full rate aren't woken for data
+ * sets they would discard. The first data set received is delivered as is.
+ *
+ * The reduction is done as each data set is received, once per subscriber,
+ * and handler is called from the same context as ahrs_sample_handler_add()
+ * handlers. Averaged data sets are timestamped at the middle of the data
+ * sets they were reduced from and have the worst heading status among them.
+ *
+ * On avr, io_ahrs_time() is 0 unless the application implements it, so
+ * interval is instead a number of data sets, eg 5 for every fifth one, and
+ * data sets are only timestamped if io_ahrs_time() is implemented.
+ *
+ * Subscribers should be added before io_ahrs_recv_start() is called. At most
+ * AHRS_NSUBSCRIBERS may be added.
+ *
+ * returns 0 on success
+ */
+int ahrs_subscribe(io_ahrs_usec interval, enum ahrs_reduce reduce,
+		void (*handler)(struct ahrs_sample const *));
+
+#ifdef AHRS_QUEUE
+/**
+ * Copies up to max of the oldest queued data sets to buf, oldest first, and
+ * removes them from the queue. When compiled with AHRS_QUEUE defined, every
+ * complete set of data received is queued, unlike ahrs_att_update(), which
+ * skips to the newest, so a consumer that needs every data set, such as a
+ * logger, can take them in batches. If the consumer falls more than
+ * AHRS_QUEUE_LEN data sets behind, new ones are dropped until it catches up.
+ *
+ * Only one thread may drain the queue. It never blocks the receiving of data.
+ *
+ * returns the number of data sets copied
+ */
+size_t ahrs_drain(struct ahrs_sample *buf, size_t max);
+
+/**
+ * returns the number of data sets dropped because the queue was full. Each
+ * run of dropped data sets is counted once the data set queued after it has
+ * been drained. Only for the thread calling ahrs_drain().
+ */
+unsigned long ahrs_queue_overflows();
+#endif
+
 /*
  * 
  *
@@ -64,16 +370,164 @@ bool ahrs_att_update();
  */
 int ahrs_att_recv();
 
+/**
+ * Parses n bytes of data received from the ahrs all at once, eg from a
+ * buffer filled by read() or from a recording, instead of reading them from
+ * io_ahrs with ahrs_att_recv(). The bytes are all timestamped as one chunk.
+ *
+ * returns the number of valid data sets completely parsed
+ */
+size_t ahrs_att_feed(unsigned char const *data, size_t n);
+
 /**
  * Causes any data from a current incomplete datagram to be discarded. The next
  * received byte will be treated as potentially the start of a datagram.
  *
- * Can be used due for, eg, a serial timeout for intra-datagram data.
+ * Can be used due for, eg, a serial timeout for intra-datagram data, though
+ * ahrs_att_recv() already does this per ahrs_parse_gap_set().
  */
 void ahrs_parse_att_reset();
 
+/**
+ * Sets the longest gap between received bytes of a datagram, in multiples of
+ * the time to transmit a byte, before ahrs_att_recv() discards the incomplete
+ * datagram as if by ahrs_parse_att_reset(). 0 disables this. Defaults to
+ * AHRS_GAP_BYTES.
+ *
+ * Relies on io_ahrs_time(), so it has no effect on avr unless the
+ * application provides a timebase.
+ */
+void ahrs_parse_gap_set(unsigned nbytes);
+
+/**
+ * returns how long before now (per io_ahrs_time()) the current attitude data
+ * was received, per ahrs_att_time().
+ */
+io_ahrs_usec ahrs_att_age(io_ahrs_usec now);
+
+/**
+ * Sets the age beyond which ahrs_att_stale() considers the current attitude
+ * data stale. 0, the default, means it is never stale.
+ */
+void ahrs_att_stale_set(io_ahrs_usec max_age);
+
+/**
+ * returns true if ahrs_att_age(now) exceeds the age set by
+ * ahrs_att_stale_set(), eg because the ahrs stopped sending data.
+ */
+bool ahrs_att_stale(io_ahrs_usec now);
+
+/*
+ * Counts of datagrams received, for monitoring the link to the ahrs. Both
+ * wrap.
+ */
+struct ahrs_link_stats
+{
+	unsigned long synced; // datagram headers synchronized with
+	unsigned long accepted; // of those, parsed into valid data sets
+};
+
+/**
+ * Copies the link counters to stats. Datagrams synchronized with but not
+ * accepted failed, eg their crc, except for one still being received. Only
+ * for whatever receives the data, eg a sample handler, from which the data
+ * set being handled is counted as accepted.
+ */
+void ahrs_link_stats(struct ahrs_link_stats *stats);
+
+/*
+ * Acquisition parameters, per kSetAcqParams
+ */
+struct ahrs_acq_params
+{
+	// true for Poll Mode, where the ahrs sends data only when asked (eg with
+	// kGetData), false for Continuous Mode
+	bool polled;
+	// true to flush the FIR filter on each new sample, which trades noise
+	// for latency
+	bool flush_filter;
+	// Continuous Mode delay, in seconds, between the end of sending one data
+	// set and the start of sending the next. 0 sends as fast as possible.
+	float sample_delay;
+};
+
+/**
+ * Sets the acquisition parameters of the ahrs with kSetAcqParams, and waits
+ * for the ahrs to confirm.
+ *
+ * Like the other commands that wait for a response, this must not be called
+ * while the receive handler is running (ie between io_ahrs_recv_start() and
+ * io_ahrs_recv_stop()).
+ *
+ * returns 0 on success
+ */
+int ahrs_set_acq_params(struct ahrs_acq_params const *params);
+
+/**
+ * Reads the acquisition parameters of the ahrs with kGetAcqParams.
+ *
+ * Must not be called while the receive handler is running.
+ *
+ * returns 0 on success
+ */
+int ahrs_get_acq_params(struct ahrs_acq_params *params);
+
+/**
+ * returns the time, in seconds, to transmit one kGetDataResp datagram of the
+ * data components parse_att() expects at the passed baud. This is the
+ * fastest interval the serial link can carry them at, so for data every
+ * interval seconds, set sample_delay to interval minus this, or 0 for as
+ * fast as possible.
+ */
+float ahrs_min_sample_interval(unsigned long baud);
+
+/**
+ * Sets the data components sent by the ahrs to those parse_att() expects:
+ * kHeading, kPitch, kRoll, and kHeadingStatus, plus kGyroX, kGyroY, and kGyroZ
+ * if compiled with AHRS_GYRO defined.
+ *
+ * returns 0 on success
+ */
 int ahrs_set_datacomp();
 
+/**
+ * Saves the configuration of the ahrs, such as its data components, to
+ * non-volatile memory with kSave, and waits for the ahrs to confirm.
+ *
+ * Must not be called while the receive handler is running.
+ *
+ * returns 0 on success
+ */
+int ahrs_save();
+
+/**
+ * Brings up the ahrs as soon as it is ready, in place of fixed waits after
+ * io_ahrs_init():
+ *   - probes with kGetModInfo until the ahrs answers, since it ignores
+ *     commands while booting
+ *   - requests a data set with kGetData and sets the data components with
+ *     ahrs_set_datacomp() only if it doesn't have those parse_att()
+ *     expects, then persists them with ahrs_save() if save is true
+ *   - starts continuous mode with ahrs_cont_start()
+ *   - returns as soon as a valid data set has been parsed, so that
+ *     ahrs_att_update() is already true when the receive handler is started
+ *
+ * Must be called before the receive handler is started. On avr, timeout is
+ * only kept if io_ahrs_time() is implemented.
+ *
+ * returns 0 on success, or -1 if any step fails or timeout passes first
+ */
+int ahrs_start(io_ahrs_usec timeout, bool save);
+
+/**
+ * Brings the ahrs back up after its device was reopened, per ahrs_start(),
+ * which replays the data components and continuous mode, waiting at most
+ * AHRS_RECONNECT_USEC. For io_ahrs_reconnect_opts.reconnect on pc.
+ *
+ * returns 0 on success, or -1 if the ahrs isn't sending data sets
+ */
+int ahrs_reconnect();
+
 #ifdef __cplusplus
 }
 #endif
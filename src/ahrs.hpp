@@ -0,0 +1,212 @@
+#ifndef AHRS_HPP
+#define AHRS_HPP
+
+/*
+ * Header-only C++20 layer over ahrs.h and io_ahrs.h. pc only.
+ *
+ * Snapshots take a whole sample in one call instead of one call per
+ * component, and Latest keeps its own triple buffer in this header, so that
+ * checking for and reading a new sample inlines into the caller.
+ */
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <stdexcept>
+#include <system_error>
+
+#include "ahrs.h"
+#include "io_ahrs.h"
+
+namespace ahrs
+{
+
+/*
+ * One complete set of data received from the ahrs.
+ */
+struct Sample : ahrs_sample
+{
+	float pitch() const { return att[PITCH]; }
+	float yaw() const { return att[YAW]; }
+	float roll() const { return att[ROLL]; }
+};
+
+/**
+ * returns the newest sample, per ahrs_att_snapshot(). Any number of threads
+ * may call this concurrently.
+ */
+inline Sample snapshot()
+{
+	Sample sample;
+	ahrs_att_snapshot(&sample);
+	return sample;
+}
+
+/**
+ * Parses bytes received from the ahrs, per ahrs_att_feed().
+ *
+ * returns the number of samples completely parsed
+ */
+inline std::size_t feed(std::span<std::byte const> const bytes)
+{
+	return ahrs_att_feed(reinterpret_cast<unsigned char const *>(bytes.data()),
+			bytes.size());
+}
+
+/*
+ * Lock-free triple buffer for one producer and one consumer, like the one in
+ * io_ahrs_pc.c but without a mutex. The index of the buffer ready for the
+ * consumer and whether it is new are packed into one atomic byte, which each
+ * side exchanges with the index of the buffer it is done with.
+ */
+template <typename T>
+class TripleBuffer
+{
+public:
+	/**
+	 * returns the buffer for the producer to write to. Only changes when
+	 * offer() is called.
+	 */
+	T &write() { return buf_[write_]; }
+
+	/**
+	 * Makes the buffer returned by write() the newest for the consumer.
+	 */
+	void offer()
+	{
+		write_ = clean_.exchange(write_ | NEW, std::memory_order_acq_rel) &
+			INDEX;
+	}
+
+	/**
+	 * Makes read() return the newest offered buffer.
+	 *
+	 * returns true if it is new since the last call
+	 */
+	bool update()
+	{
+		if (!(clean_.load(std::memory_order_relaxed) & NEW))
+		{
+			return false;
+		}
+		read_ = clean_.exchange(read_, std::memory_order_acq_rel) & INDEX;
+		return true;
+	}
+
+	/**
+	 * returns the buffer for the consumer to read from. Only changes when
+	 * update() returns true.
+	 */
+	T const &read() const { return buf_[read_]; }
+
+private:
+	static constexpr std::uint8_t INDEX = 0x3U;
+	static constexpr std::uint8_t NEW = 0x4U;
+
+	// each on its own cache line, since each side writes its own index
+	alignas(64) T buf_[3] = {};
+	alignas(64) std::uint8_t write_ = 0;
+	alignas(64) std::atomic<std::uint8_t> clean_ = 1;
+	alignas(64) std::uint8_t read_ = 2;
+};
+
+/*
+ * The newest sample for a single consumer, handed off through an inlinable
+ * TripleBuffer. Create one before the receive thread starts, since it adds a
+ * sample handler. Only one may exist.
+ */
+class Latest
+{
+public:
+	Latest()
+	{
+		if (ahrs_sample_handler_add(handler))
+		{
+			throw std::length_error("No room for another ahrs sample handler");
+		}
+	}
+
+	Latest(Latest const &) = delete;
+	Latest &operator=(Latest const &) = delete;
+
+	/**
+	 * Makes get() return the newest sample.
+	 *
+	 * returns true if it is new since the last call
+	 */
+	bool update() { return buf().update(); }
+
+	Sample const &get() const { return buf().read(); }
+
+private:
+	static TripleBuffer<Sample> &buf()
+	{
+		static TripleBuffer<Sample> b;
+		return b;
+	}
+
+	static void handler(ahrs_sample const *const sample)
+	{
+		static_cast<ahrs_sample &>(buf().write()) = *sample;
+		buf().offer();
+	}
+};
+
+/*
+ * Owns the device opened with io_ahrs_init() until destroyed.
+ */
+class Device
+{
+public:
+	explicit Device(char const *const path)
+	{
+		io_ahrs_init(path);
+		if (!io_ahrs)
+		{
+			throw std::system_error(errno, std::generic_category(), path);
+		}
+	}
+
+	~Device() { io_ahrs_clean(); }
+
+	Device(Device const &) = delete;
+	Device &operator=(Device const &) = delete;
+};
+
+/*
+ * Runs the receive handler, ahrs_att_recv() by default, on a receive thread
+ * until destroyed.
+ */
+class ReceiveThread
+{
+public:
+	explicit ReceiveThread(int (*const handler)() = ahrs_att_recv)
+	{
+		if (int const err = io_ahrs_recv_start(handler))
+		{
+			throw std::system_error(err, std::generic_category(),
+					"io_ahrs_recv_start");
+		}
+	}
+
+	ReceiveThread(io_ahrs_recv_opts const &opts,
+			int (*const handler)() = ahrs_att_recv)
+	{
+		if (int const err = io_ahrs_recv_start_opts(handler, &opts))
+		{
+			throw std::system_error(err, std::generic_category(),
+					"io_ahrs_recv_start_opts");
+		}
+	}
+
+	~ReceiveThread() { io_ahrs_recv_stop(); }
+
+	ReceiveThread(ReceiveThread const &) = delete;
+	ReceiveThread &operator=(ReceiveThread const &) = delete;
+};
+
+}
+
+#endif
@@ -0,0 +1,82 @@
+#ifndef AHRS_BATCH_H
+#define AHRS_BATCH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+#include "ahrs.h"
+
+/*
+ * Analysis of many samples at once, such as those read back from a log, in
+ * structure of arrays form. pc only.
+ *
+ * The kernels use AVX2 if compiled for it (eg make CFLAGS_pc=-mavx2), else
+ * SSE2 on x86, else plain C, and give the same results with each up to
+ * rounding. Unless noted otherwise, arrays may not overlap.
+ */
+
+/*
+ * n samples, one array per quantity
+ */
+struct ahrs_batch
+{
+	size_t n;
+	float *att[NUM_ATT_AXES]; // indexed by enum att_axis, as from ahrs_att()
+	double *time; // seconds, per io_ahrs_time()
+};
+
+struct ahrs_batch_stats
+{
+	float min, max, mean, rms;
+};
+
+/**
+ * Fills the arrays of batch, which must have room for batch->n samples, from
+ * the first batch->n of samples.
+ */
+void ahrs_batch_from_samples(struct ahrs_batch const *batch,
+		struct ahrs_sample const *samples);
+
+/**
+ * Writes n headings from heading, in ahrs_range[YAW], to unwrapped, adding
+ * whole turns so that it changes continuously across north. unwrapped[0]
+ * equals heading[0]. Assumes consecutive headings differ by less than half a
+ * turn.
+ */
+void ahrs_batch_unwrap(float const *heading, float *unwrapped, size_t n);
+
+/**
+ * Writes the n - 1 rates of change, in degrees per second, between
+ * consecutive samples of n angles and their times to rate. Angles that wrap,
+ * such as the heading, should be unwrapped first.
+ */
+void ahrs_batch_rate(float const *angle, double const *time, float *rate,
+		size_t n);
+
+/**
+ * Writes the statistics of each consecutive window of window values of n
+ * values of x to stats, the last window being partial if window doesn't
+ * divide n.
+ *
+ * returns the number of windows written, ie n / window rounded up, or 0 if
+ * window is 0
+ */
+size_t ahrs_batch_stats(float const *x, size_t n, size_t window,
+		struct ahrs_batch_stats *stats);
+
+/**
+ * Writes the unit quaternions (w, x, y, z), of the same rotation as
+ * ahrs_att_quaternion(), of n attitudes in att to q. Angles must be within
+ * ahrs_range.
+ */
+void ahrs_batch_quaternion(float const *const att[NUM_ATT_AXES],
+		float *const q[4], size_t n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
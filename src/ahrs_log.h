@@ -0,0 +1,114 @@
+#ifndef AHRS_LOG_H
+#define AHRS_LOG_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ahrs.h"
+
+/*
+ * Compact binary log of samples, indexed by time. pc only.
+ *
+ * The file is a sequence of AHRS_LOG_BLOCK_SIZE byte blocks. The first holds
+ * a file header. Each of the rest holds the first sample it covers in full,
+ * followed by as many samples as fit, each delta encoded against the one
+ * before it: the time delta and the angle deltas (in binary angle units, see
+ * struct ahrs_compact) as variable length integers, and the heading status
+ * only when it changes. A typical sample takes about 6 bytes.
+ *
+ * Closing the log appends an index of the first time of each block, which
+ * lets a reader find any time in O(log n) without decoding earlier blocks.
+ * Since blocks are fixed size, a log that was never closed (eg due to a
+ * crash) can still be searched by the headers of its blocks.
+ *
+ * All multibyte values are little endian, so logs are portable.
+ */
+
+#define AHRS_LOG_BLOCK_SIZE 4096U
+
+struct ahrs_log;
+
+/**
+ * Creates a log file at path, overwriting any existing file.
+ *
+ * returns NULL on failure
+ */
+struct ahrs_log *ahrs_log_create(char const *path);
+
+/**
+ * Appends sample to log. Samples must be appended in order of time. Angles
+ * are stored to the resolution of binary angle units (about 0.0055 degrees),
+ * and any members of sample besides att, headingstatus, and time are not
+ * stored.
+ *
+ * Full blocks are written out by a thread of the log, so this never waits
+ * on the disk. If the disk falls behind by a whole block, the samples of the
+ * next block are dropped, and counted by ahrs_log_dropped().
+ *
+ * returns 0 on success
+ */
+int ahrs_log_write(struct ahrs_log *log, struct ahrs_sample const *sample);
+
+/**
+ * returns the number of samples dropped because the disk fell behind
+ */
+uint64_t ahrs_log_dropped(struct ahrs_log *log);
+
+/**
+ * Writes the remaining samples and the index, and closes log.
+ *
+ * returns 0 on success
+ */
+int ahrs_log_close(struct ahrs_log *log);
+
+/**
+ * Makes every sample received from the ahrs be written to log, from the
+ * receive thread, or stops doing so if log is NULL. Must first be called
+ * before io_ahrs_recv_start(), since it adds a sample handler. Once it
+ * returns, the receive thread is done with any log attached before, which
+ * can then be closed, so detach with NULL before closing log.
+ *
+ * returns 0 on success
+ */
+int ahrs_log_attach(struct ahrs_log *log);
+
+
+struct ahrs_log_reader;
+
+/**
+ * Maps the log file at path for reading, positioned at its first sample.
+ *
+ * returns NULL on failure
+ */
+struct ahrs_log_reader *ahrs_log_open(char const *path);
+
+void ahrs_log_reader_close(struct ahrs_log_reader *reader);
+
+/**
+ * returns the number of samples in the log, found without decoding them.
+ */
+uint64_t ahrs_log_count(struct ahrs_log_reader const *reader);
+
+/**
+ * Positions reader at the first sample with a time at or after time, using a
+ * binary search over the blocks, so that only one block is decoded.
+ */
+void ahrs_log_seek(struct ahrs_log_reader *reader, io_ahrs_usec time);
+
+/**
+ * Decodes the sample at the position of reader to sample, and advances to the
+ * next one. Members of sample that are not stored are zeroed.
+ *
+ * returns 0 on success, or -1 at the end of the log or on a corrupt block
+ */
+int ahrs_log_next(struct ahrs_log_reader *reader, struct ahrs_sample *sample);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef AHRS_SHM_H
+#define AHRS_SHM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include "ahrs.h"
+
+/*
+ * Publishes samples to a POSIX shared memory segment, so any number of other
+ * processes can read them without syscalls or copies through the kernel. pc
+ * only.
+ *
+ * The segment holds a ring of the AHRS_SHM_NSLOTS most recent samples, each
+ * guarded by its own sequence lock, so readers never block the publisher or
+ * each other. Every sample is numbered by its generation, starting from 1.
+ */
+
+#ifndef AHRS_SHM_NSLOTS
+#define AHRS_SHM_NSLOTS 256U // must be a power of 2
+#endif
+
+struct ahrs_shm;
+
+/**
+ * Creates (or recreates) the shared memory object name, eg "/ahrs", and starts
+ * writing each sample received from the ahrs to it. Must be called before
+ * io_ahrs_recv_start(), since it adds a sample handler.
+ *
+ * returns 0 on success
+ */
+int ahrs_shm_publish_start(char const *name);
+
+/**
+ * Stops publishing and removes the shared memory object. Readers that have it
+ * mapped may keep reading the samples already in it. Safe to call while the
+ * receive thread is running: it waits for a sample being published to be
+ * finished with.
+ */
+void ahrs_shm_publish_stop();
+
+/**
+ * Maps the shared memory object name created by ahrs_shm_publish_start(),
+ * possibly in another process.
+ *
+ * returns NULL on failure, including when the object was created by a
+ * publisher compiled with a different struct ahrs_sample (ie with other
+ * AHRS_GYRO, AHRS_COMPACT or AHRS_CLOCK options) or AHRS_SHM_NSLOTS
+ */
+struct ahrs_shm const *ahrs_shm_open(char const *name);
+
+void ahrs_shm_close(struct ahrs_shm const *shm);
+
+/**
+ * Copies the newest sample in shm to sample.
+ *
+ * returns the generation of the copied sample, or 0 if none has been
+ * published yet
+ */
+uint64_t ahrs_shm_latest(struct ahrs_shm const *shm, struct ahrs_sample *sample);
+
+/**
+ * Copies the sample of generation gen in shm to sample. Recent samples can
+ * be walked by counting down from the generation returned by
+ * ahrs_shm_latest().
+ *
+ * returns 0 on success, or -1 if that generation has not been published yet or
+ * has already been overwritten
+ */
+int ahrs_shm_get(struct ahrs_shm const *shm, uint64_t gen,
+		struct ahrs_sample *sample);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,81 @@
+#include <string.h>
+
+#include "ahrs_telem.h"
+#include "crc_xmodem.h"
+
+
+// What every frame begins with
+static unsigned char const HEADER[3] = {
+	AHRS_TELEM_SIZE >> 8, AHRS_TELEM_SIZE & 0xFFU, AHRS_TELEM_FRAME_ID};
+
+void ahrs_telem_encode(struct ahrs_compact const *const compact,
+		unsigned char buf[AHRS_TELEM_SIZE])
+{
+	memcpy(buf, HEADER, sizeof(HEADER));
+	ahrs_compact_pack(compact, buf + sizeof(HEADER));
+	uint16_t crc = CRC_XMODEM_INIT_VAL;
+	for (uint_fast8_t i = 0; i < AHRS_TELEM_SIZE - 2; ++i)
+	{
+		crc = crc_xmodem_update(crc, buf[i]);
+	}
+	buf[AHRS_TELEM_SIZE - 2] = crc >> 8;
+	buf[AHRS_TELEM_SIZE - 1] = crc;
+}
+
+/*
+ * returns true if the n bytes of buf could be the start of a frame
+ */
+static bool header_match(unsigned char const *const buf, uint_fast8_t const n)
+{
+	for (uint_fast8_t i = 0; i < n && i < sizeof(HEADER); ++i)
+	{
+		if (buf[i] != HEADER[i])
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Drops the first byte held by decoder, and then as many more as it takes
+ * for the rest to possibly start a frame.
+ */
+static void resync(struct ahrs_telem_decoder *const decoder)
+{
+	do
+	{
+		memmove(decoder->buf, decoder->buf + 1, --decoder->n);
+	} while (decoder->n && !header_match(decoder->buf, decoder->n));
+}
+
+bool ahrs_telem_decode(struct ahrs_telem_decoder *const decoder,
+		unsigned char const c, struct ahrs_compact *const compact)
+{
+	decoder->buf[decoder->n++] = c;
+	if (!header_match(decoder->buf, decoder->n))
+	{
+		resync(decoder);
+		return false;
+	}
+	if (decoder->n < AHRS_TELEM_SIZE)
+	{
+		return false;
+	}
+
+	// The crc of a value with its crc appended is 0.
+	uint16_t crc = CRC_XMODEM_INIT_VAL;
+	for (uint_fast8_t i = 0; i < AHRS_TELEM_SIZE; ++i)
+	{
+		crc = crc_xmodem_update(crc, decoder->buf[i]);
+	}
+	if (crc)
+	{
+		++decoder->bad_crc;
+		resync(decoder);
+		return false;
+	}
+	ahrs_compact_unpack(compact, decoder->buf + sizeof(HEADER));
+	decoder->n = 0;
+	return true;
+}
@@ -0,0 +1,58 @@
+#ifndef AHRS_TELEM_H
+#define AHRS_TELEM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ahrs.h"
+
+/*
+ * Binary telemetry frames, for relaying attitude over a serial link far more
+ * cheaply than formatting it as text. A frame is framed like a TRAX
+ * datagram: the big endian byte count of the whole frame, the frame ID
+ * AHRS_TELEM_FRAME_ID, a struct ahrs_compact as packed by
+ * ahrs_compact_pack(), then the big endian crc16 xmodem of all before it.
+ * The frame ID is not one the ahrs uses, so frames can't be mistaken for
+ * its datagrams. Platform independent.
+ */
+
+#define AHRS_TELEM_SIZE (5U + AHRS_COMPACT_SIZE)
+#define AHRS_TELEM_FRAME_ID 0xC5U
+
+/**
+ * Writes compact to buf as one frame of exactly AHRS_TELEM_SIZE bytes.
+ */
+void ahrs_telem_encode(struct ahrs_compact const *compact,
+		unsigned char buf[AHRS_TELEM_SIZE]);
+
+/*
+ * State of finding frames in a byte stream. Zero initialize before first
+ * use.
+ */
+struct ahrs_telem_decoder
+{
+	unsigned char buf[AHRS_TELEM_SIZE];
+	uint_fast8_t n; // bytes of buf held
+	unsigned long bad_crc; // frames that failed their crc, which wraps
+};
+
+/**
+ * Adds byte c from the stream to decoder. Bytes that can't begin a frame are
+ * skipped, and after a frame fails its crc, the search for the next resumes
+ * from the byte after the start of the failed one.
+ *
+ * returns true if c completed a valid frame, which is then unpacked to
+ * compact
+ */
+bool ahrs_telem_decode(struct ahrs_telem_decoder *decoder, unsigned char c,
+		struct ahrs_compact *compact);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
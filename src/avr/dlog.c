@@ -0,0 +1,84 @@
+#include <stdint.h>
+#include <util/atomic.h>
+
+#include "dlog.h"
+
+
+#ifndef DLOG_LEN
+#define DLOG_LEN 16U // must be a power of 2 no more than 128
+#endif
+
+// Recorded from interrupt handlers as well, so both ends are only moved
+// with interrupts disabled, which is shorter than any lock free scheme
+// would be on an 8 bit cpu
+static struct
+{
+	struct dlog_site const *site;
+	long a, b;
+} ring[DLOG_LEN];
+static uint8_t head, tail;
+static unsigned long dropped;
+
+// Drained by the application's main loop, so there is nothing to start
+int dlog_init()
+{
+	return 0;
+}
+
+void dlog_record(struct dlog_site const *const site, long const a,
+		long const b)
+{
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		if ((uint8_t)(head - tail) == DLOG_LEN)
+		{
+			++dropped;
+		}
+		else
+		{
+			uint8_t const i = head++ % DLOG_LEN;
+			ring[i].site = site;
+			ring[i].a = a;
+			ring[i].b = b;
+		}
+	}
+}
+
+size_t dlog_drain(FILE *const out)
+{
+	size_t n = 0;
+	for (;; ++n)
+	{
+		struct dlog_site const *site = NULL;
+		long a = 0, b = 0;
+		ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+		{
+			if (tail != head)
+			{
+				uint8_t const i = tail++ % DLOG_LEN;
+				site = ring[i].site;
+				a = ring[i].a;
+				b = ring[i].b;
+			}
+		}
+		if (!site)
+		{
+			break;
+		}
+		fprintf(out, "DEBUG %s:%d: ", site->file, site->line);
+		fprintf(out, site->fmt, a, b);
+		fprintf(out, "\n");
+	}
+	unsigned long lost;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		lost = dropped;
+		dropped = 0;
+	}
+	if (lost)
+	{
+		fprintf(out, "DEBUG %s:%d: %lu messages dropped.\n", __FILE__,
+				__LINE__, lost);
+	}
+	return n;
+}
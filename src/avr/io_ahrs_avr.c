@@ -5,6 +5,7 @@
 #include <assert.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include <util/delay.h>
 
 #ifdef __STDC_NO_ATOMICS__
 #error "stdatomic.h unsupported. If necessary, use of stdatomic can be removed and it can be hacked together with volatile instead."
@@ -14,7 +15,7 @@
 
 #include "io_ahrs.h"
 #include "macrodef.h"
-#include "dbg.h"
+#include "dlog.h"
 
 
 #define NUSART 3
@@ -53,7 +54,7 @@ static int uart_ahrs_getchar(FILE *stream)
 
 	if (status & (1U << CC_XXX(FE, NUSART, ))) // was stop bit incorrect (zero)?
 	{
-		DEBUG("Frame Error on usart " STRINGIFY_X(NUSART) ". Out-of-sync or break condition may have occured.");
+		DLOG("Frame Error on usart " STRINGIFY_X(NUSART) ". Out-of-sync or break condition may have occured.");
 		// Return rather than waiting for the next byte because we don't want
 		// to block if reading from a Receive Complete Interrupt.
 		return _FDEV_EOF;
@@ -63,7 +64,7 @@ static int uart_ahrs_getchar(FILE *stream)
 	{
 		// At least one frame was lost due to data being received while the
 		// receive buffer was full.
-		DEBUG("Receive buffer overrun on usart " STRINGIFY_X(NUSART) ". At least one uart frame lost.");
+		DLOG("Receive buffer overrun on usart " STRINGIFY_X(NUSART) ". At least one uart frame lost.");
 		// No indication of this is made. The caller is expected to be handling
 		// synchronization and error checking above this layer.
 	}
@@ -148,6 +149,40 @@ void io_ahrs_recv_stop()
 	return;
 }
 
+/**
+ * There is no timer reserved for this library on the avr, so by default every
+ * timestamp is 0 (which makes every sample appear to be exactly current). An
+ * application with its own timebase (eg a timer overflow counter) should
+ * override this by defining its own io_ahrs_time().
+ */
+__attribute__((weak)) io_ahrs_usec io_ahrs_time()
+{
+	return 0;
+}
+
+int io_ahrs_getc_timeout(io_ahrs_usec timeout)
+{
+	// io_ahrs_time() may not be provided, so time by busy waiting instead
+	for (; !(CC_XXX(UCSR, NUSART, A) & (1U << CC_XXX(RXC, NUSART, ))); --timeout)
+	{
+		if (!timeout)
+		{
+			return EOF;
+		}
+		_delay_us(1); // plus the loop overhead, so timeouts run somewhat long
+	}
+	int const c = uart_ahrs_getchar(io_ahrs);
+	return c < 0 ? EOF : c; // _FDEV_EOF on a frame error
+}
+
+int io_ahrs_getc_chunk(bool *const chunk)
+{
+	// Called from the receive interrupt, once per byte
+	*chunk = true;
+	int const c = getc(io_ahrs);
+	return c < 0 ? EOF : c;
+}
+
 // new is initialized to 0, so the reader/consumer can know initially when
 // there has been any valid data (eg waiting to run PID until a complete data
 // set has been received from the ahrs.)
@@ -234,3 +269,69 @@ unsigned char io_ahrs_tripbuf_read()
 {
 	return tripbuf.read;
 }
+
+// odd while the writer is changing the data it guards. The writer may be
+// handler_ahrs_recv, so this is volatile so its changes are visible outside
+// the ISR. 8 bits wide so that accesses are atomic; a reader would have to be
+// interrupted by 128 writes for a wrapped sequence to go unnoticed.
+static volatile unsigned char seqlock;
+
+/**
+ * May interrupt readers, but may not be interrupted by them
+ */
+void io_ahrs_seqlock_write_begin()
+{
+	++seqlock;
+	// Try to ensure data writes are not ordered before the sequence change
+	atomic_signal_fence(memory_order_release);
+}
+
+void io_ahrs_seqlock_write_end()
+{
+	atomic_signal_fence(memory_order_release);
+	++seqlock;
+}
+
+unsigned io_ahrs_seqlock_read_begin()
+{
+	// A reader never interrupts the writer, so the writer can't be mid-write
+	// here unless this is itself called from the writer.
+	unsigned char const seq = seqlock;
+	atomic_signal_fence(memory_order_acquire);
+	return seq;
+}
+
+bool io_ahrs_seqlock_read_retry(unsigned const seq)
+{
+	atomic_signal_fence(memory_order_acquire);
+	return seqlock != (unsigned char)seq;
+}
+
+// Single bytes, so loads and stores can't be torn by the interrupt
+static volatile unsigned char queue_head, queue_tail;
+
+unsigned io_ahrs_queue_head()
+{
+	unsigned char const head = queue_head;
+	atomic_signal_fence(memory_order_acquire);
+	return head;
+}
+
+void io_ahrs_queue_head_set(unsigned const head)
+{
+	atomic_signal_fence(memory_order_release);
+	queue_head = head;
+}
+
+unsigned io_ahrs_queue_tail()
+{
+	unsigned char const tail = queue_tail;
+	atomic_signal_fence(memory_order_acquire);
+	return tail;
+}
+
+void io_ahrs_queue_tail_set(unsigned const tail)
+{
+	atomic_signal_fence(memory_order_release);
+	queue_tail = tail;
+}
@@ -0,0 +1,65 @@
+#ifndef dlog_h
+#define dlog_h
+
+#include <stdio.h>
+
+/*
+ * Deferred debug messages, for paths where formatting and writing a message
+ * with DEBUG() would change the timing being debugged, such as the parser
+ * and interrupt handlers. DLOG(fmt, ...) only records where it was called
+ * and at most two integer arguments, which are converted to long, so fmt
+ * must format them as such (eg %ld, %lu, %lX). It is a few stores into a
+ * lock free ring of the most recent DLOG_LEN records, from which messages
+ * are formatted later, in the same form as DEBUG(): on pc by a background
+ * thread started by dlog_init(), and on avr by the application calling
+ * dlog_drain() from its main loop. If the ring is full, records are dropped
+ * and counted, never waited for.
+ *
+ * Like DEBUG(), DLOG() compiles to nothing when NDEBUG is defined.
+ */
+
+// Where a DLOG() is, one per call site
+struct dlog_site
+{
+	char const *file;
+	int line;
+	char const *fmt;
+};
+
+#ifdef NDEBUG
+#define DLOG(...)
+#else
+// The padding lets a message without arguments be recorded the same way.
+#define DLOG(...) DLOG_(__VA_ARGS__, 0, 0, 0)
+#define DLOG_(fmt, a, b, ...) \
+	do \
+	{ \
+		static struct dlog_site const dlog_site_ = {__FILE__, __LINE__, fmt}; \
+		dlog_record(&dlog_site_, (long)(a), (long)(b)); \
+	} while (0)
+#endif
+
+void dlog_record(struct dlog_site const *site, long a, long b);
+
+/**
+ * On pc, starts the thread that formats the recorded messages to stderr every
+ * DLOG_DRAIN_NSEC, and once more at exit. It is started with every signal
+ * blocked, so it never takes a signal an application waits for with
+ * sigwait() or handles on a thread of its own. io_ahrs_init() calls this, so
+ * only applications that parse without it need to. Until then, messages
+ * are only recorded. Does nothing on other platforms, and after the first
+ * call.
+ *
+ * returns 0 on success, or -1 if the thread couldn't be started
+ */
+int dlog_init();
+
+/**
+ * Formats the recorded messages to out, oldest first, followed by a count of
+ * any that were dropped. Must not be called from an interrupt handler.
+ *
+ * returns the number of messages formatted
+ */
+size_t dlog_drain(FILE *out);
+
+#endif
@@ -7,6 +7,18 @@ extern "C" {
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Monotonic time in microseconds. Only differences between timestamps are
+ * meaningful. On avr it is only 32 bits, so it wraps after about 71 minutes
+ * and differences must be taken with unsigned arithmetic.
+ */
+#ifdef AVR
+typedef uint32_t io_ahrs_usec;
+#else
+typedef uint64_t io_ahrs_usec;
+#endif
 
 void io_ahrs_init(char const *path);
 
@@ -17,8 +29,115 @@ void io_ahrs_clean();
  */
 int io_ahrs_recv_start(int (*handler)());
 
+/**
+ * Stops the receive handler. On pc, the receive thread has exited by the
+ * time this returns, so commands can then be exchanged on io_ahrs.
+ */
 void io_ahrs_recv_stop();
 
+#ifndef AVR
+/*
+ * Options for the receive thread started by io_ahrs_recv_start_opts. Zero
+ * initialized members leave the corresponding default in place.
+ */
+struct io_ahrs_recv_opts
+{
+	int priority; // SCHED_FIFO priority, or 0 for the default scheduling
+	uint64_t cpus; // bit n allows running on cpu n, or 0 for any cpu
+	// Preallocated stack of stack_size bytes, which is locked in memory. If
+	// NULL, stack_size, if nonzero, sets the size of the allocated stack.
+	void *stack;
+	size_t stack_size;
+	bool mlockall; // lock all current and future pages of the process
+};
+
+/**
+ * Same as io_ahrs_recv_start, except the receive thread is set up per opts,
+ * for bounded receive latency. With PLATFORM=mem, which has no receive
+ * thread, opts are ignored.
+ *
+ * returns 0 on success, or an errno value. EPERM from priority means
+ * CAP_SYS_NICE or a high enough RLIMIT_RTPRIO is missing. For stack and
+ * mlockall, ENOMEM usually means RLIMIT_MEMLOCK is too low without
+ * CAP_IPC_LOCK, and EPERM that it is 0. A DEBUG message says which. On
+ * failure, nothing is left locked in memory.
+ */
+int io_ahrs_recv_start_opts(int (*handler)(),
+		struct io_ahrs_recv_opts const *opts);
+
+/*
+ * State of the connection to the ahrs device, per io_ahrs_reconnect_set
+ */
+enum io_ahrs_conn
+{
+	IO_AHRS_CONNECTED,
+	IO_AHRS_DISCONNECTED, // lost, and being reopened
+	IO_AHRS_CONFIGURING // reopened, and the reconnect callback is running
+};
+
+struct io_ahrs_conn_stats
+{
+	enum io_ahrs_conn state;
+	io_ahrs_usec since; // io_ahrs_time() when state was entered
+	unsigned long losses; // times the connection was lost
+	// From losing the connection to the reconnect callback succeeding, of
+	// the most recent and of the longest outage, and of all outages. With
+	// ahrs_reconnect() as the callback, that is when the first valid data
+	// set after reconnecting has been parsed. Without a callback, it is as
+	// soon as the device is reopened.
+	io_ahrs_usec last_downtime;
+	io_ahrs_usec max_downtime;
+	io_ahrs_usec total_downtime;
+};
+
+/*
+ * Options for reconnecting, per io_ahrs_reconnect_set. Zero initialized
+ * members leave the corresponding default in place.
+ */
+struct io_ahrs_reconnect_opts
+{
+	// Run on the receive thread once the device is reopened, before the
+	// receive handler is, eg ahrs_reconnect() to replay the configuration.
+	// returns 0 on success, or anything else to close the device and try
+	// again after the backoff. NULL only reopens.
+	int (*reconnect)();
+	// Run on the receive thread on each change of state, eg to report it
+	void (*state_changed)(struct io_ahrs_conn_stats const *stats);
+	// Wait before each attempt to reopen after the first, doubling from
+	// backoff_min (default 10 ms) up to backoff_max (default 1 s)
+	io_ahrs_usec backoff_min;
+	io_ahrs_usec backoff_max;
+};
+
+/**
+ * Makes the receive thread reconnect when reading the device hits end of
+ * file or an error, eg when a usb serial adapter resets, rather than
+ * exiting. It reopens the path passed to io_ahrs_init() until that
+ * succeeds, then runs opts->reconnect, and only then goes back to running
+ * the receive handler. io_ahrs stays a valid stream throughout, so commands
+ * on it just fail while the device is gone. The device may come back under
+ * another name, so a stable path such as one in /dev/serial/by-id is best.
+ * Only a character device (a tty) can be reconnected to, since the end of a
+ * regular file or a fifo is the end of the data rather than a lost device.
+ *
+ * opts->reconnect runs with cancellation disabled, so io_ahrs_recv_stop()
+ * waits for it to return, if it is running. With ahrs_reconnect(), that can
+ * block io_ahrs_recv_stop() for up to AHRS_RECONNECT_USEC, since each attempt
+ * may take that long.
+ * With PLATFORM=mem, there is no device to lose, so this fails with errno
+ * ENOSYS.
+ *
+ * returns 0 on success, or -1 if io_ahrs is not a character device
+ */
+int io_ahrs_reconnect_set(struct io_ahrs_reconnect_opts const *opts);
+
+/**
+ * Copies the state of the connection and its outages so far to stats, from
+ * any thread. With PLATFORM=mem, it is always connected, without outages.
+ */
+void io_ahrs_conn_stats(struct io_ahrs_conn_stats *stats);
+#endif
+
 /**
  * io with this is blocking, so one might use normal stdio functions directly
  * on it when they are willing to wait, eg sending initial configuration data,
@@ -27,6 +146,35 @@ void io_ahrs_recv_stop();
  */
 extern FILE *io_ahrs;
 
+/**
+ * returns the current monotonic time, used to timestamp received data.
+ */
+io_ahrs_usec io_ahrs_time();
+
+/**
+ * Reads a byte from io_ahrs, waiting at most timeout for one to arrive. For
+ * command/response exchanges, so it must not be used while the receive
+ * handler started by io_ahrs_recv_start is running.
+ *
+ * returns the byte as an unsigned char converted to an int, or EOF on timeout
+ * or error
+ */
+int io_ahrs_getc_timeout(io_ahrs_usec timeout);
+
+/**
+ * Reads the next byte received, for the receive handler, waiting for one if
+ * need be, and sets *chunk to whether it begins a newly received chunk: bytes
+ * that arrived together, and so can share a timestamp. On pc, a chunk is
+ * what one read() of the device returns, and bytes are read that way rather
+ * than through the stdio buffer of io_ahrs, which the receive thread takes
+ * over when it starts. Whatever of the last chunk it hasn't read when it is
+ * stopped is dropped. On avr, every byte is a chunk of its own.
+ *
+ * returns the byte as an unsigned char converted to an int, or EOF at the
+ * end of the data or on an error
+ */
+int io_ahrs_getc_chunk(bool *chunk);
+
 /**
  * Causes io_ahrs_tripbuf_read to return index that was most recently
  * 'submitted' by io_ahrs_tripbuf_offer.
@@ -47,6 +195,50 @@ bool io_ahrs_tripbuf_update();
  */
 void io_ahrs_tripbuf_offer();
 
+/**
+ * Sequence lock for the single data set published to multiple readers. The
+ * one writer brackets its changes with io_ahrs_seqlock_write_begin/end. A
+ * reader copies the data between io_ahrs_seqlock_read_begin and
+ * io_ahrs_seqlock_read_retry, and must discard the copy and start over if
+ * io_ahrs_seqlock_read_retry returns true.
+ *
+ * The sequence number is even when the data is not being written, and is
+ * incremented by each begin and end, so it is twice the number of completed
+ * writes. Readers never block the writer.
+ */
+void io_ahrs_seqlock_write_begin();
+
+void io_ahrs_seqlock_write_end();
+
+/**
+ * returns the sequence number to pass to io_ahrs_seqlock_read_retry. Waits
+ * while a write is in progress.
+ */
+unsigned io_ahrs_seqlock_read_begin();
+
+/**
+ * returns true if the data read since io_ahrs_seqlock_read_begin returned seq
+ * may be inconsistent.
+ */
+bool io_ahrs_seqlock_read_retry(unsigned seq);
+
+/**
+ * Indices of the single producer, single consumer queue of every data set,
+ * used by ahrs.c if AHRS_QUEUE is defined. The producer, whatever receives
+ * data, only sets head and the consumer only sets tail.
+ *
+ * Setting an index orders the queue accesses before it before the store, and
+ * getting the other side's index orders the queue accesses after it after
+ * the load. Indices are less than 256 on avr.
+ */
+unsigned io_ahrs_queue_head();
+
+void io_ahrs_queue_head_set(unsigned head);
+
+unsigned io_ahrs_queue_tail();
+
+void io_ahrs_queue_tail_set(unsigned tail);
+
 /**
  * returns the index of the buffer the data consumer should read from. Only
  * changes if io_ahrs_tripbuf_update is called and returns true.
@@ -0,0 +1,89 @@
+#ifndef IO_AHRS_MEM_H
+#define IO_AHRS_MEM_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stddef.h>
+
+#include "io_ahrs.h"
+
+/*
+ * In-memory loopback implementation of io_ahrs.h, built with PLATFORM=mem,
+ * for benchmarking and testing the library without a device, the kernel or
+ * threads, so that runs are repeatable:
+ *   - io_ahrs is a stdio stream whose reads come from the source set with
+ *     io_ahrs_mem_source() or io_ahrs_mem_source_gen(), and whose writes, ie
+ *     commands, are appended to a capture buffer. io_ahrs_init() ignores
+ *     its path.
+ *   - io_ahrs_time() is a simulated clock, advanced only by
+ *     io_ahrs_mem_time_set(), by io_ahrs_mem_byte_usec_set() per byte read,
+ *     and by io_ahrs_getc_timeout() running out its timeout once the source
+ *     is exhausted, rather than waiting.
+ *   - There is no receive thread. io_ahrs_recv_start() only sets the
+ *     receive handler, which io_ahrs_mem_pump() then runs on the calling
+ *     thread.
+ * Everything, including the triple buffer, must therefore be used from one
+ * thread. DLOG() messages are only written out by dlog_drain().
+ */
+
+/*
+ * Generates received bytes: writes at most n to buf, as one chunk arriving
+ * together.
+ *
+ * returns the number written, or 0 at the end of the data
+ */
+typedef size_t (*io_ahrs_mem_gen)(unsigned char *buf, size_t n, void *arg);
+
+/**
+ * Makes the n bytes at data, which must remain valid while they are read,
+ * the data received, replacing any previous source and anything of it not
+ * yet read.
+ */
+void io_ahrs_mem_source(unsigned char const *data, size_t n);
+
+/**
+ * Makes the bytes generated by gen, passed arg, the data received, replacing
+ * any previous source and anything of it not yet read. A generator may use
+ * io_ahrs_mem_capture() to answer commands.
+ */
+void io_ahrs_mem_source_gen(io_ahrs_mem_gen gen, void *arg);
+
+/**
+ * Sets the time io_ahrs_time() returns until next advanced.
+ */
+void io_ahrs_mem_time_set(io_ahrs_usec now);
+
+/**
+ * Sets how far the clock advances per byte read from the source, eg
+ * 1000000 * 10 / baud to simulate a serial link. Each chunk is read as
+ * soon as it is asked for, and the clock advances by the whole chunk as it
+ * is read. A buffer source is read in chunks of at most 64 bytes, like the
+ * packets of a usb serial adapter. Default 0.
+ */
+void io_ahrs_mem_byte_usec_set(io_ahrs_usec usec);
+
+/**
+ * Runs the receive handler set by io_ahrs_recv_start() until it returns EOF,
+ * eg at the end of the source, or until it has run max times, if max is
+ * nonzero.
+ *
+ * returns the number of times it returned other than EOF
+ */
+size_t io_ahrs_mem_pump(size_t max);
+
+/**
+ * returns the bytes written to io_ahrs since io_ahrs_init() or
+ * io_ahrs_mem_capture_clear(), and sets *n to their number. Valid until the
+ * next write or clear.
+ */
+unsigned char const *io_ahrs_mem_capture(size_t *n);
+
+void io_ahrs_mem_capture_clear();
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
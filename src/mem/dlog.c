@@ -0,0 +1,54 @@
+#include "dlog.h"
+
+
+#ifndef DLOG_LEN
+#define DLOG_LEN 256U
+#endif
+
+// Only ever used from one thread, per io_ahrs_mem.h
+static struct
+{
+	struct dlog_site const *site;
+	long a, b;
+} ring[DLOG_LEN];
+static size_t head, tail;
+static unsigned long dropped;
+
+// Drained by the application, per io_ahrs_mem.h
+int dlog_init()
+{
+	return 0;
+}
+
+void dlog_record(struct dlog_site const *const site, long const a,
+		long const b)
+{
+	if (head - tail == DLOG_LEN)
+	{
+		++dropped;
+		return;
+	}
+	size_t const i = head++ % DLOG_LEN;
+	ring[i].site = site;
+	ring[i].a = a;
+	ring[i].b = b;
+}
+
+size_t dlog_drain(FILE *const out)
+{
+	size_t n = 0;
+	for (; tail != head; ++n, ++tail)
+	{
+		size_t const i = tail % DLOG_LEN;
+		fprintf(out, "DEBUG %s:%d: ", ring[i].site->file, ring[i].site->line);
+		fprintf(out, ring[i].site->fmt, ring[i].a, ring[i].b);
+		fprintf(out, "\n");
+	}
+	if (dropped)
+	{
+		fprintf(out, "DEBUG %s:%d: %lu messages dropped.\n", __FILE__,
+				__LINE__, dropped);
+		dropped = 0;
+	}
+	return n;
+}
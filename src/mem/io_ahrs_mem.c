@@ -0,0 +1,318 @@
+#define _GNU_SOURCE // for fopencookie and __fpurge
+#include <stdio.h>
+#include <stdio_ext.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+
+#include "io_ahrs.h"
+#include "io_ahrs_mem.h"
+#include "macrodef.h"
+#include "dbg.h"
+
+
+FILE *io_ahrs;
+
+static int (*handler_recv)();
+
+static io_ahrs_usec now, byte_usec;
+
+// set by mem_read() when stdio refills its buffer, ie a chunk arrives
+static bool chunk_new;
+
+// Most bytes of a buffer source read at once, like a usb serial adapter
+// packet, so the clock advances in steps well within AHRS_GAP_BYTES
+#define CHUNK_MAX 64U
+
+static struct
+{
+	unsigned char const *data; // or NULL if gen is used
+	size_t n;
+	io_ahrs_mem_gen gen;
+	void *arg;
+} source;
+
+static struct
+{
+	unsigned char *data;
+	size_t n, size;
+} capture;
+
+
+static ssize_t mem_read(void *const cookie, char *const buf, size_t const n)
+{
+	(void)cookie;
+	size_t got;
+	if (source.gen)
+	{
+		got = source.gen((unsigned char *)buf, n, source.arg);
+	}
+	else
+	{
+		got = n < source.n ? n : source.n;
+		got = got < CHUNK_MAX ? got : CHUNK_MAX;
+		memcpy(buf, source.data, got);
+		source.data += got;
+		source.n -= got;
+	}
+	now += (io_ahrs_usec)got * byte_usec;
+	chunk_new = got;
+	return got;
+}
+
+static ssize_t mem_write(void *const cookie, char const *const buf,
+		size_t const n)
+{
+	(void)cookie;
+	if (capture.size - capture.n < n)
+	{
+		size_t size = capture.size ? capture.size : 256U;
+		while (size - capture.n < n)
+		{
+			size *= 2;
+		}
+		unsigned char *const data = realloc(capture.data, size);
+		if (!data)
+		{
+			DEBUG("Out of memory for the capture buffer.");
+			return -1;
+		}
+		capture.data = data;
+		capture.size = size;
+	}
+	memcpy(capture.data + capture.n, buf, n);
+	capture.n += n;
+	return n;
+}
+
+void io_ahrs_init(char const *path)
+{
+	(void)path;
+	io_ahrs = fopencookie(NULL, "r+", (cookie_io_functions_t){
+			.read = mem_read, .write = mem_write});
+	if (!io_ahrs)
+	{
+		DEBUG("Failed to create the in-memory stream.");
+	}
+	capture.n = 0;
+	return;
+}
+
+void io_ahrs_clean()
+{
+	fclose(io_ahrs);
+	free(capture.data);
+	capture.data = NULL;
+	capture.n = capture.size = 0;
+	return;
+}
+
+void io_ahrs_mem_source(unsigned char const *const data, size_t const n)
+{
+	// drop what stdio has buffered of the previous source
+	__fpurge(io_ahrs);
+	clearerr(io_ahrs);
+	source.data = data;
+	source.n = n;
+	source.gen = NULL;
+}
+
+void io_ahrs_mem_source_gen(io_ahrs_mem_gen const gen, void *const arg)
+{
+	__fpurge(io_ahrs);
+	clearerr(io_ahrs);
+	source.data = NULL;
+	source.n = 0;
+	source.gen = gen;
+	source.arg = arg;
+}
+
+void io_ahrs_mem_time_set(io_ahrs_usec const time)
+{
+	now = time;
+}
+
+void io_ahrs_mem_byte_usec_set(io_ahrs_usec const usec)
+{
+	byte_usec = usec;
+}
+
+unsigned char const *io_ahrs_mem_capture(size_t *const n)
+{
+	*n = capture.n;
+	return capture.data;
+}
+
+void io_ahrs_mem_capture_clear()
+{
+	capture.n = 0;
+}
+
+int io_ahrs_recv_start(int (*handler)())
+{
+	handler_recv = handler;
+	return 0;
+}
+
+int io_ahrs_recv_start_opts(int (*handler)(),
+		struct io_ahrs_recv_opts const *opts)
+{
+	(void)opts; // there is no thread to set up
+	return io_ahrs_recv_start(handler);
+}
+
+void io_ahrs_recv_stop()
+{
+	handler_recv = NULL;
+	return;
+}
+
+int io_ahrs_reconnect_set(struct io_ahrs_reconnect_opts const *opts)
+{
+	(void)opts;
+	DEBUG("There is no device to reconnect to.");
+	errno = ENOSYS;
+	return -1;
+}
+
+void io_ahrs_conn_stats(struct io_ahrs_conn_stats *const stats)
+{
+	// never lost
+	*stats = (struct io_ahrs_conn_stats){.state = IO_AHRS_CONNECTED};
+}
+
+size_t io_ahrs_mem_pump(size_t const max)
+{
+	size_t n = 0;
+	while (handler_recv && (!max || n < max))
+	{
+		if (handler_recv() == EOF)
+		{
+			// so that reading resumes if the source has more later
+			clearerr(io_ahrs);
+			break;
+		}
+		++n;
+	}
+	return n;
+}
+
+io_ahrs_usec io_ahrs_time()
+{
+	return now;
+}
+
+int io_ahrs_getc_chunk(bool *const chunk)
+{
+	chunk_new = false;
+	int const c = getc(io_ahrs);
+	*chunk = chunk_new;
+	return c;
+}
+
+int io_ahrs_getc_timeout(io_ahrs_usec const timeout)
+{
+	// Nothing more can arrive while waiting, so don't.
+	int const c = getc(io_ahrs);
+	if (c == EOF)
+	{
+		clearerr(io_ahrs);
+		now += timeout;
+	}
+	return c;
+}
+
+/*
+ * The producer and consumer are on the same thread, so the triple buffer,
+ * sequence lock and queue indices need no locks or atomics, but otherwise
+ * behave as on pc.
+ */
+static struct
+{
+	unsigned char write : 2;
+	unsigned char clean : 2;
+	unsigned char read  : 2;
+	unsigned char new   : 1;
+} tripbuf = {0, 1, 2, false};
+
+bool io_ahrs_tripbuf_update()
+{
+	assert(IN_RANGE(0, tripbuf.write, 2) && IN_RANGE(0, tripbuf.clean, 2) &&
+			IN_RANGE(0, tripbuf.read, 2) && IN_RANGE (0, tripbuf.new, 1));
+
+	if (!tripbuf.new)
+	{
+		return false;
+	}
+	tripbuf.new = false;
+	unsigned char tmp = tripbuf.read;
+	tripbuf.read = tripbuf.clean;
+	tripbuf.clean = tmp;
+	return true;
+}
+
+void io_ahrs_tripbuf_offer()
+{
+	assert(IN_RANGE(0, tripbuf.write, 2) && IN_RANGE(0, tripbuf.clean, 2) &&
+			IN_RANGE(0, tripbuf.read, 2) && IN_RANGE (0, tripbuf.new, 1));
+
+	unsigned char tmp = tripbuf.write;
+	tripbuf.write = tripbuf.clean;
+	tripbuf.clean = tmp;
+	tripbuf.new = true;
+}
+
+unsigned char io_ahrs_tripbuf_write()
+{
+	return tripbuf.write;
+}
+
+unsigned char io_ahrs_tripbuf_read()
+{
+	return tripbuf.read;
+}
+
+static unsigned seqlock;
+
+void io_ahrs_seqlock_write_begin()
+{
+	++seqlock;
+}
+
+void io_ahrs_seqlock_write_end()
+{
+	++seqlock;
+}
+
+unsigned io_ahrs_seqlock_read_begin()
+{
+	return seqlock;
+}
+
+bool io_ahrs_seqlock_read_retry(unsigned const seq)
+{
+	return seqlock != seq;
+}
+
+static unsigned queue_head, queue_tail;
+
+unsigned io_ahrs_queue_head()
+{
+	return queue_head;
+}
+
+void io_ahrs_queue_head_set(unsigned const head)
+{
+	queue_head = head;
+}
+
+unsigned io_ahrs_queue_tail()
+{
+	return queue_tail;
+}
+
+void io_ahrs_queue_tail_set(unsigned const tail)
+{
+	queue_tail = tail;
+}
@@ -0,0 +1,380 @@
+#include <math.h>
+
+#include "ahrs_batch.h"
+
+
+/*
+ * Operations on vectors of VLEN floats, so that each kernel is written once
+ * for every instruction set. Masks from comparisons are only used with
+ * vwhere() and vselect().
+ */
+#if defined(__AVX2__)
+#include <immintrin.h>
+
+#define VLEN 8
+typedef __m256 vf;
+
+#define vload(p) _mm256_loadu_ps(p)
+#define vstore(p, a) _mm256_storeu_ps(p, a)
+#define vset1(x) _mm256_set1_ps(x)
+#define vadd(a, b) _mm256_add_ps(a, b)
+#define vsub(a, b) _mm256_sub_ps(a, b)
+#define vmul(a, b) _mm256_mul_ps(a, b)
+#define vdiv(a, b) _mm256_div_ps(a, b)
+#define vmin(a, b) _mm256_min_ps(a, b)
+#define vmax(a, b) _mm256_max_ps(a, b)
+#define vgt(a, b) _mm256_cmp_ps(a, b, _CMP_GT_OQ)
+#define vlt(a, b) _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+// a where m, else 0
+#define vwhere(m, a) _mm256_and_ps(m, a)
+// a where m, else b
+#define vselect(m, a, b) _mm256_blendv_ps(b, a, m)
+
+// returns time[i + 1] - time[i] for each lane i
+static vf vload_dt(double const *const time)
+{
+	__m128 const lo = _mm256_cvtpd_ps(_mm256_sub_pd(
+				_mm256_loadu_pd(time + 1), _mm256_loadu_pd(time)));
+	__m128 const hi = _mm256_cvtpd_ps(_mm256_sub_pd(
+				_mm256_loadu_pd(time + 5), _mm256_loadu_pd(time + 4)));
+	return _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+}
+
+// returns the inclusive prefix sum of the lanes
+static vf vprefix(vf x)
+{
+	// within each 128 bit half, then carry the low half into the high
+	x = _mm256_add_ps(x, _mm256_castsi256_ps(
+				_mm256_slli_si256(_mm256_castps_si256(x), 4)));
+	x = _mm256_add_ps(x, _mm256_castsi256_ps(
+				_mm256_slli_si256(_mm256_castps_si256(x), 8)));
+	__m256 const low = _mm256_permute2f128_ps(x, x, 0x08);
+	return _mm256_add_ps(x, _mm256_shuffle_ps(low, low, 0xFF));
+}
+
+static float vlast(vf const x)
+{
+	return _mm_cvtss_f32(_mm_shuffle_ps(_mm256_extractf128_ps(x, 1),
+				_mm256_extractf128_ps(x, 1), 0xFF));
+}
+
+static float vhsum(vf const x)
+{
+	__m128 s = _mm_add_ps(_mm256_castps256_ps128(x),
+			_mm256_extractf128_ps(x, 1));
+	s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+	return _mm_cvtss_f32(_mm_add_ss(s, _mm_shuffle_ps(s, s, 0x55)));
+}
+
+static float vhmin(vf const x)
+{
+	__m128 s = _mm_min_ps(_mm256_castps256_ps128(x),
+			_mm256_extractf128_ps(x, 1));
+	s = _mm_min_ps(s, _mm_movehl_ps(s, s));
+	return _mm_cvtss_f32(_mm_min_ss(s, _mm_shuffle_ps(s, s, 0x55)));
+}
+
+static float vhmax(vf const x)
+{
+	__m128 s = _mm_max_ps(_mm256_castps256_ps128(x),
+			_mm256_extractf128_ps(x, 1));
+	s = _mm_max_ps(s, _mm_movehl_ps(s, s));
+	return _mm_cvtss_f32(_mm_max_ss(s, _mm_shuffle_ps(s, s, 0x55)));
+}
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+
+#define VLEN 4
+typedef __m128 vf;
+
+#define vload(p) _mm_loadu_ps(p)
+#define vstore(p, a) _mm_storeu_ps(p, a)
+#define vset1(x) _mm_set1_ps(x)
+#define vadd(a, b) _mm_add_ps(a, b)
+#define vsub(a, b) _mm_sub_ps(a, b)
+#define vmul(a, b) _mm_mul_ps(a, b)
+#define vdiv(a, b) _mm_div_ps(a, b)
+#define vmin(a, b) _mm_min_ps(a, b)
+#define vmax(a, b) _mm_max_ps(a, b)
+#define vgt(a, b) _mm_cmpgt_ps(a, b)
+#define vlt(a, b) _mm_cmplt_ps(a, b)
+#define vwhere(m, a) _mm_and_ps(m, a)
+#define vselect(m, a, b) _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b))
+
+static vf vload_dt(double const *const time)
+{
+	__m128 const lo = _mm_cvtpd_ps(_mm_sub_pd(_mm_loadu_pd(time + 1),
+				_mm_loadu_pd(time)));
+	__m128 const hi = _mm_cvtpd_ps(_mm_sub_pd(_mm_loadu_pd(time + 3),
+				_mm_loadu_pd(time + 2)));
+	return _mm_movelh_ps(lo, hi);
+}
+
+static vf vprefix(vf x)
+{
+	x = _mm_add_ps(x, _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(x), 4)));
+	return _mm_add_ps(x,
+			_mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(x), 8)));
+}
+
+static float vlast(vf const x)
+{
+	return _mm_cvtss_f32(_mm_shuffle_ps(x, x, 0xFF));
+}
+
+static float vhsum(vf x)
+{
+	x = _mm_add_ps(x, _mm_movehl_ps(x, x));
+	return _mm_cvtss_f32(_mm_add_ss(x, _mm_shuffle_ps(x, x, 0x55)));
+}
+
+static float vhmin(vf x)
+{
+	x = _mm_min_ps(x, _mm_movehl_ps(x, x));
+	return _mm_cvtss_f32(_mm_min_ss(x, _mm_shuffle_ps(x, x, 0x55)));
+}
+
+static float vhmax(vf x)
+{
+	x = _mm_max_ps(x, _mm_movehl_ps(x, x));
+	return _mm_cvtss_f32(_mm_max_ss(x, _mm_shuffle_ps(x, x, 0x55)));
+}
+#else
+#define VLEN 1
+typedef float vf;
+
+#define vload(p) (*(p))
+#define vstore(p, a) (*(p) = (a))
+#define vset1(x) (x)
+#define vadd(a, b) ((a) + (b))
+#define vsub(a, b) ((a) - (b))
+#define vmul(a, b) ((a) * (b))
+#define vdiv(a, b) ((a) / (b))
+#define vmin(a, b) ((a) < (b) ? (a) : (b)) // like minps, b if either is NaN
+#define vmax(a, b) ((a) > (b) ? (a) : (b))
+#define vgt(a, b) ((a) > (b))
+#define vlt(a, b) ((a) < (b))
+#define vwhere(m, a) ((m) ? (a) : 0.f)
+#define vselect(m, a, b) ((m) ? (a) : (b))
+#define vload_dt(time) ((float)((time)[1] - (time)[0]))
+#define vprefix(x) (x)
+#define vlast(x) (x)
+#define vhsum(x) (x)
+#define vhmin(x) (x)
+#define vhmax(x) (x)
+#endif
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+
+void ahrs_batch_from_samples(struct ahrs_batch const *const batch,
+		struct ahrs_sample const *const samples)
+{
+	for (size_t i = 0; i < batch->n; ++i)
+	{
+		for (enum att_axis a = 0; a < NUM_ATT_AXES; ++a)
+		{
+			batch->att[a][i] = samples[i].att[a];
+		}
+		batch->time[i] = samples[i].time * 1e-6;
+	}
+}
+
+/*
+ * Unwraps VLEN headings, from heading[0], given the offset in whole turns of
+ * the one before them.
+ *
+ * returns the offset of the last one
+ */
+static float unwrap(float const *const restrict heading,
+		float *const restrict unwrapped, float const offset, float const turn)
+{
+	vf const cur = vload(heading);
+	vf const d = vsub(cur, vload(heading - 1));
+	vf const step = vadd(vwhere(vgt(d, vset1(turn / 2)), vset1(-turn)),
+			vwhere(vlt(d, vset1(-turn / 2)), vset1(turn)));
+	// the offset of each is that of the one before plus its own step
+	vf const off = vadd(vprefix(step), vset1(offset));
+	vstore(unwrapped, vadd(cur, off));
+	return vlast(off);
+}
+
+void ahrs_batch_unwrap(float const *const restrict heading,
+		float *const restrict unwrapped, size_t const n)
+{
+	if (!n)
+	{
+		return;
+	}
+	float const turn = ahrs_range[YAW][COMPONENT_MAX] -
+		ahrs_range[YAW][COMPONENT_MIN];
+	unwrapped[0] = heading[0];
+	float offset = 0.f;
+	size_t i = 1;
+	for (; i + VLEN <= n; i += VLEN)
+	{
+		offset = unwrap(heading + i, unwrapped + i, offset, turn);
+	}
+	for (; i < n; ++i)
+	{
+		float const d = heading[i] - heading[i - 1];
+		offset += d > turn / 2 ? -turn : d < -turn / 2 ? turn : 0.f;
+		unwrapped[i] = heading[i] + offset;
+	}
+}
+
+void ahrs_batch_rate(float const *const restrict angle,
+		double const *const restrict time, float *const restrict rate,
+		size_t const n)
+{
+	size_t i = 0;
+	for (; i + VLEN < n; i += VLEN)
+	{
+		vstore(rate + i, vdiv(vsub(vload(angle + i + 1), vload(angle + i)),
+					vload_dt(time + i)));
+	}
+	for (; i + 1 < n; ++i)
+	{
+		rate[i] = (angle[i + 1] - angle[i]) / (float)(time[i + 1] - time[i]);
+	}
+}
+
+size_t ahrs_batch_stats(float const *const restrict x, size_t const n,
+		size_t const window, struct ahrs_batch_stats *const restrict stats)
+{
+	size_t nwindows = 0;
+	if (!window)
+	{
+		return 0;
+	}
+	for (size_t begin = 0; begin < n; begin += window)
+	{
+		size_t const len = n - begin < window ? n - begin : window;
+		float const *const w = x + begin;
+
+		size_t i = 0;
+		float min = w[0], max = w[0], sum = 0.f, sumsq = 0.f;
+		if (len >= VLEN)
+		{
+			vf vmn = vload(w), vmx = vmn, vs = vset1(0.f), vss = vset1(0.f);
+			for (; i + VLEN <= len; i += VLEN)
+			{
+				vf const v = vload(w + i);
+				vmn = vmin(vmn, v);
+				vmx = vmax(vmx, v);
+				vs = vadd(vs, v);
+				vss = vadd(vss, vmul(v, v));
+			}
+			min = vhmin(vmn);
+			max = vhmax(vmx);
+			sum = vhsum(vs);
+			sumsq = vhsum(vss);
+		}
+		for (; i < len; ++i)
+		{
+			min = fminf(min, w[i]);
+			max = fmaxf(max, w[i]);
+			sum += w[i];
+			sumsq += w[i] * w[i];
+		}
+
+		stats[nwindows++] = (struct ahrs_batch_stats){
+			.min = min,
+			.max = max,
+			.mean = sum / len,
+			.rms = sqrtf(sumsq / len)};
+	}
+	return nwindows;
+}
+
+/*
+ * Sine and cosine of angles in [-pi/2, pi), which is where half of any angle
+ * in ahrs_range lies. The Taylor series to x^11 and x^12 are within 1e-7 over
+ * [-pi/2, pi/2], onto which the rest is reflected.
+ */
+static void sincos_half(vf x, vf *const s, vf *const c)
+{
+	float const pi = (float)M_PI;
+	// sin(pi - x) == sin(x), cos(pi - x) == -cos(x)
+	vf const reflect = vgt(x, vset1(pi / 2));
+	x = vselect(reflect, vsub(vset1(pi), x), x);
+	vf const z = vmul(x, x);
+
+	vf sp = vset1(-1.f / 39916800);
+	sp = vadd(vmul(sp, z), vset1(1.f / 362880));
+	sp = vadd(vmul(sp, z), vset1(-1.f / 5040));
+	sp = vadd(vmul(sp, z), vset1(1.f / 120));
+	sp = vadd(vmul(sp, z), vset1(-1.f / 6));
+	*s = vadd(x, vmul(vmul(sp, z), x));
+
+	vf cp = vset1(1.f / 479001600);
+	cp = vadd(vmul(cp, z), vset1(-1.f / 3628800));
+	cp = vadd(vmul(cp, z), vset1(1.f / 40320));
+	cp = vadd(vmul(cp, z), vset1(-1.f / 720));
+	cp = vadd(vmul(cp, z), vset1(1.f / 24));
+	cp = vadd(vmul(cp, z), vset1(-1.f / 2));
+	vf const cv = vadd(vset1(1.f), vmul(cp, z));
+	*c = vselect(reflect, vsub(vset1(0.f), cv), cv);
+}
+
+/*
+ * Converts VLEN attitudes, from index i
+ */
+static void quaternion(float const *const att[NUM_ATT_AXES],
+		float *const q[4], size_t const i)
+{
+	vf const half = vset1((float)M_PI / 360.f); // half an angle in radians
+	vf sp, cp, sy, cy, sr, cr;
+	sincos_half(vmul(vload(att[PITCH] + i), half), &sp, &cp);
+	sincos_half(vmul(vload(att[YAW] + i), half), &sy, &cy);
+	sincos_half(vmul(vload(att[ROLL] + i), half), &sr, &cr);
+
+	vf const cpcy = vmul(cp, cy), spsy = vmul(sp, sy);
+	vf const cpsy = vmul(cp, sy), spcy = vmul(sp, cy);
+	vstore(q[0] + i, vadd(vmul(cr, cpcy), vmul(sr, spsy)));
+	vstore(q[1] + i, vsub(vmul(sr, cpcy), vmul(cr, spsy)));
+	vstore(q[2] + i, vadd(vmul(cr, spcy), vmul(sr, cpsy)));
+	vstore(q[3] + i, vsub(vmul(cr, cpsy), vmul(sr, spcy)));
+}
+
+void ahrs_batch_quaternion(float const *const att[NUM_ATT_AXES],
+		float *const q[4], size_t const n)
+{
+	size_t i = 0;
+	for (; i + VLEN <= n; i += VLEN)
+	{
+		quaternion(att, q, i);
+	}
+	if (i < n)
+	{
+		if (n >= VLEN)
+		{
+			// redo a last full vector overlapping the one before
+			quaternion(att, q, n - VLEN);
+		}
+		else
+		{
+			// too few for a vector, so go through one that is padded
+			float pad[NUM_ATT_AXES][VLEN] = {{0}}, qpad[4][VLEN];
+			for (enum att_axis a = 0; a < NUM_ATT_AXES; ++a)
+			{
+				for (size_t j = 0; j < n; ++j)
+				{
+					pad[a][j] = att[a][j];
+				}
+			}
+			quaternion((float const *const[NUM_ATT_AXES]){pad[0], pad[1],
+					pad[2]}, (float *const[4]){qpad[0], qpad[1], qpad[2],
+					qpad[3]}, 0);
+			for (unsigned k = 0; k < 4; ++k)
+			{
+				for (size_t j = 0; j < n; ++j)
+				{
+					q[k][j] = qpad[k][j];
+				}
+			}
+		}
+	}
+}
@@ -0,0 +1,657 @@
+#define _POSIX_C_SOURCE 200809L
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ahrs_log.h"
+#include "dbg.h"
+
+
+static unsigned char const LOG_MAGIC[8] = "AHRSLOG";
+static unsigned char const INDEX_MAGIC[8] = "AHRSIDX";
+#define LOG_VERSION 1U
+
+/*
+ * File header, in the first block:
+ *  0: magic
+ *  8: u32 version
+ * 12: u32 block size
+ * 16: u64 io_ahrs_time() when created
+ * 24: u64 CLOCK_REALTIME in us when created, to relate the two timebases
+ *
+ * Block header:
+ *  0: u64 time of first sample
+ *  8: u64 time of last sample
+ * 16: u32 number of samples
+ * 20: u32 bytes of delta encoded samples following the header
+ * 24: u16[3] angles of first sample
+ * 30: u8 heading status of first sample
+ * 31: u8 reserved
+ *
+ * Index, after the last block:
+ * u64[number of blocks] time of first sample of each block, then u64 number
+ * of blocks, then index magic
+ */
+#define BLOCK_HEADER_SIZE 32U
+
+// 10 byte time delta + 3 * 3 byte angle deltas + 1 byte heading status
+#define MAX_DELTA_SIZE 20U
+
+
+static void put_le(unsigned char *const buf, uint64_t val, unsigned const n)
+{
+	for (unsigned i = 0; i < n; ++i, val >>= 8)
+	{
+		buf[i] = val;
+	}
+}
+
+static uint64_t get_le(unsigned char const *const buf, unsigned const n)
+{
+	uint64_t val = 0;
+	for (unsigned i = n; i--;)
+	{
+		val = val << 8 | buf[i];
+	}
+	return val;
+}
+
+/*
+ * Writes val as an LEB128 variable length integer.
+ *
+ * returns number of bytes written
+ */
+static unsigned put_varint(unsigned char *const buf, uint64_t val)
+{
+	unsigned n = 0;
+	for (; val >= 0x80U; val >>= 7)
+	{
+		buf[n++] = val | 0x80U;
+	}
+	buf[n++] = val;
+	return n;
+}
+
+/*
+ * returns number of bytes read, or 0 if the integer runs past end
+ */
+static unsigned get_varint(unsigned char const *const buf,
+		unsigned char const *const end, uint64_t *const val)
+{
+	*val = 0;
+	for (unsigned n = 0; buf + n < end && n < 10; ++n)
+	{
+		*val |= (uint64_t)(buf[n] & 0x7FU) << 7 * n;
+		if (!(buf[n] & 0x80U))
+		{
+			return n + 1;
+		}
+	}
+	return 0;
+}
+
+// maps small signed angle deltas to small unsigned integers
+static unsigned zigzag(int16_t const d)
+{
+	return d < 0 ? ~(unsigned)d << 1 | 1U : (unsigned)d << 1;
+}
+
+static int16_t unzigzag(uint64_t const z)
+{
+	return z & 1U ? (int16_t)~(z >> 1) : (int16_t)(z >> 1);
+}
+
+
+struct ahrs_log
+{
+	FILE *file;
+	pthread_t writer;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	// block[active] is being filled by ahrs_log_write(), and block[!active],
+	// while full is set, is being written out by the writer thread, so that
+	// the receive thread never waits on the disk.
+	unsigned char block[2][AHRS_LOG_BLOCK_SIZE];
+	unsigned active;
+	bool full;
+	bool stopping;
+	bool write_failed;
+	uint64_t dropped; // samples
+	size_t used; // bytes of block[active] used, including the header
+	uint32_t nsamples; // in block[active]
+	// previous sample, to delta encode against
+	io_ahrs_usec time;
+	uint16_t att[NUM_ATT_AXES];
+	uint8_t headingstatus;
+	// first time of each block written so far
+	uint64_t *index;
+	size_t nblocks;
+	size_t index_cap;
+	int error;
+};
+
+/*
+ * Writes out each block handed over by flush_block(), until stopping.
+ */
+static void *writer(void *const arg)
+{
+	struct ahrs_log *const log = arg;
+	pthread_mutex_lock(&log->lock);
+	for (;;)
+	{
+		while (!log->full && !log->stopping)
+		{
+			pthread_cond_wait(&log->cond, &log->lock);
+		}
+		if (!log->full)
+		{
+			break;
+		}
+		unsigned char const *const block = log->block[!log->active];
+		pthread_mutex_unlock(&log->lock);
+		bool const failed = fwrite(block, AHRS_LOG_BLOCK_SIZE, 1, log->file) != 1;
+		if (failed)
+		{
+			DEBUG("Failed to write log block.");
+		}
+		pthread_mutex_lock(&log->lock);
+		log->write_failed = log->write_failed || failed;
+		log->full = false;
+		pthread_cond_broadcast(&log->cond);
+	}
+	pthread_mutex_unlock(&log->lock);
+	return NULL;
+}
+
+struct ahrs_log *ahrs_log_create(char const *const path)
+{
+	struct ahrs_log *const log = calloc(1, sizeof(*log));
+	if (!log)
+	{
+		return NULL;
+	}
+	if (!(log->file = fopen(path, "wb")))
+	{
+		DEBUG("Failed to create log %s", path);
+		free(log);
+		return NULL;
+	}
+
+	struct timespec real;
+	clock_gettime(CLOCK_REALTIME, &real);
+	unsigned char *const header = log->block[0];
+	memcpy(header, LOG_MAGIC, sizeof(LOG_MAGIC));
+	put_le(header + 8, LOG_VERSION, 4);
+	put_le(header + 12, AHRS_LOG_BLOCK_SIZE, 4);
+	put_le(header + 16, io_ahrs_time(), 8);
+	put_le(header + 24,
+			(uint64_t)real.tv_sec * 1000000U + real.tv_nsec / 1000, 8);
+	if (fwrite(header, AHRS_LOG_BLOCK_SIZE, 1, log->file) != 1)
+	{
+		DEBUG("Failed to write log header to %s", path);
+		fclose(log->file);
+		free(log);
+		return NULL;
+	}
+
+	pthread_mutex_init(&log->lock, NULL);
+	pthread_cond_init(&log->cond, NULL);
+	// Started with every signal blocked, like the dlog drain thread, so that
+	// it never takes a signal meant for a thread of the application.
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	int const err = pthread_create(&log->writer, NULL, writer, log);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err)
+	{
+		DEBUG("Failed to start the log writer thread.");
+		pthread_cond_destroy(&log->cond);
+		pthread_mutex_destroy(&log->lock);
+		fclose(log->file);
+		free(log);
+		return NULL;
+	}
+	return log;
+}
+
+/*
+ * Hands the block being filled to the writer thread. If the writer is still
+ * busy with the one before, either waits for it, or if not wait, drops the
+ * samples of the block and counts them instead.
+ */
+static int flush_block(struct ahrs_log *const log, bool const wait)
+{
+	if (!log->nsamples)
+	{
+		return 0;
+	}
+	pthread_mutex_lock(&log->lock);
+	while (log->full && wait)
+	{
+		pthread_cond_wait(&log->cond, &log->lock);
+	}
+	bool const busy = log->full;
+	bool const failed = log->write_failed;
+	if (busy && !failed)
+	{
+		log->dropped += log->nsamples;
+	}
+	pthread_mutex_unlock(&log->lock);
+	if (failed)
+	{
+		return -1;
+	}
+	if (busy)
+	{
+		log->nsamples = 0;
+		log->used = 0;
+		return 0;
+	}
+
+	if (log->nblocks == log->index_cap)
+	{
+		size_t const cap = log->index_cap ? 2 * log->index_cap : 256;
+		uint64_t *const index = realloc(log->index, cap * sizeof(*index));
+		if (!index)
+		{
+			return -1;
+		}
+		log->index = index;
+		log->index_cap = cap;
+	}
+	unsigned char *const block = log->block[log->active];
+	log->index[log->nblocks++] = get_le(block, 8);
+
+	put_le(block + 8, log->time, 8);
+	put_le(block + 16, log->nsamples, 4);
+	put_le(block + 20, log->used - BLOCK_HEADER_SIZE, 4);
+	memset(block + log->used, 0, AHRS_LOG_BLOCK_SIZE - log->used);
+	pthread_mutex_lock(&log->lock);
+	log->active = !log->active;
+	log->full = true;
+	pthread_cond_broadcast(&log->cond);
+	pthread_mutex_unlock(&log->lock);
+	log->nsamples = 0;
+	log->used = 0;
+	return 0;
+}
+
+int ahrs_log_write(struct ahrs_log *const log,
+		struct ahrs_sample const *const sample)
+{
+	if (log->error)
+	{
+		return -1;
+	}
+	if (log->used + MAX_DELTA_SIZE > AHRS_LOG_BLOCK_SIZE &&
+			(log->error = flush_block(log, false)))
+	{
+		return -1;
+	}
+
+	uint16_t att[NUM_ATT_AXES];
+	for (unsigned i = 0; i < NUM_ATT_AXES; ++i)
+	{
+		att[i] = ahrs_deg_to_bam(sample->att[i]);
+	}
+
+	unsigned char *const buf = log->block[log->active];
+	if (!log->nsamples)
+	{
+		put_le(buf, sample->time, 8);
+		for (unsigned i = 0; i < NUM_ATT_AXES; ++i)
+		{
+			put_le(buf + 24 + 2 * i, att[i], 2);
+		}
+		buf[30] = sample->headingstatus;
+		buf[31] = 0;
+		log->used = BLOCK_HEADER_SIZE;
+	}
+	else
+	{
+		// The low bit of the time delta flags a heading status change
+		bool const hs_changed = sample->headingstatus != log->headingstatus;
+		uint64_t const dt = sample->time - log->time;
+		log->used += put_varint(buf + log->used, dt << 1 | hs_changed);
+		for (unsigned i = 0; i < NUM_ATT_AXES; ++i)
+		{
+			log->used += put_varint(buf + log->used,
+					zigzag((int16_t)(att[i] - log->att[i])));
+		}
+		if (hs_changed)
+		{
+			buf[log->used++] = sample->headingstatus;
+		}
+	}
+	++log->nsamples;
+	log->time = sample->time;
+	memcpy(log->att, att, sizeof(att));
+	log->headingstatus = sample->headingstatus;
+	return 0;
+}
+
+uint64_t ahrs_log_dropped(struct ahrs_log *const log)
+{
+	pthread_mutex_lock(&log->lock);
+	uint64_t const dropped = log->dropped;
+	pthread_mutex_unlock(&log->lock);
+	return dropped;
+}
+
+int ahrs_log_close(struct ahrs_log *const log)
+{
+	int err = log->error || flush_block(log, true);
+	pthread_mutex_lock(&log->lock);
+	log->stopping = true;
+	pthread_cond_broadcast(&log->cond);
+	pthread_mutex_unlock(&log->lock);
+	pthread_join(log->writer, NULL);
+	err = err || log->write_failed;
+	if (!err)
+	{
+		unsigned char buf[8];
+		for (size_t i = 0; i < log->nblocks && !err; ++i)
+		{
+			put_le(buf, log->index[i], 8);
+			err = fwrite(buf, sizeof(buf), 1, log->file) != 1;
+		}
+		put_le(buf, log->nblocks, 8);
+		err = err || fwrite(buf, sizeof(buf), 1, log->file) != 1 ||
+			fwrite(INDEX_MAGIC, sizeof(INDEX_MAGIC), 1, log->file) != 1;
+	}
+	err = fclose(log->file) || err;
+	pthread_cond_destroy(&log->cond);
+	pthread_mutex_destroy(&log->lock);
+	free(log->index);
+	free(log);
+	return err ? -1 : 0;
+}
+
+static struct ahrs_log *_Atomic attached;
+// set while log_sample() may be using attached, so ahrs_log_attach() can
+// wait for it to finish with the log it replaces
+static atomic_bool logging;
+
+static void log_sample(struct ahrs_sample const *const sample)
+{
+	// io_ahrs_recv_stop() cancels the receive thread, which must not happen
+	// with logging set, or ahrs_log_attach() would wait for it forever.
+	int cancel_state;
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+	// Both sides store and then load the other's variable, sequentially
+	// consistent, so either this sees the new log or the attacher sees
+	// logging set.
+	atomic_store(&logging, true);
+	struct ahrs_log *const log = atomic_load(&attached);
+	if (log)
+	{
+		ahrs_log_write(log, sample);
+	}
+	atomic_store_explicit(&logging, false, memory_order_release);
+	pthread_setcancelstate(cancel_state, NULL);
+}
+
+int ahrs_log_attach(struct ahrs_log *const log)
+{
+	static bool handler_added;
+	if (!handler_added)
+	{
+		if (ahrs_sample_handler_add(log_sample))
+		{
+			return -1;
+		}
+		handler_added = true;
+	}
+	atomic_store(&attached, log);
+	// so the log replaced can be closed as soon as this returns
+	while (atomic_load(&logging))
+	{
+		sched_yield();
+	}
+	return 0;
+}
+
+
+struct ahrs_log_reader
+{
+	unsigned char const *map;
+	size_t size;
+	size_t nblocks;
+	unsigned char const *index; // NULL if the log was not closed
+	// position
+	size_t block;
+	uint32_t sample; // within block
+	unsigned char const *next; // delta of the next sample within block
+	// previous sample decoded
+	io_ahrs_usec time;
+	uint16_t att[NUM_ATT_AXES];
+	uint8_t headingstatus;
+};
+
+static unsigned char const *block_at(struct ahrs_log_reader const *const r,
+		size_t const block)
+{
+	return r->map + (block + 1) * AHRS_LOG_BLOCK_SIZE;
+}
+
+static uint64_t block_time(struct ahrs_log_reader const *const r,
+		size_t const block)
+{
+	if (r->index)
+	{
+		return get_le(r->index + 8 * block, 8);
+	}
+	return get_le(block_at(r, block), 8);
+}
+
+struct ahrs_log_reader *ahrs_log_open(char const *const path)
+{
+	int const fd = open(path, O_RDONLY);
+	if (fd == -1)
+	{
+		DEBUG("Failed to open log %s", path);
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size < AHRS_LOG_BLOCK_SIZE)
+	{
+		DEBUG("Log %s is too short.", path);
+		close(fd);
+		return NULL;
+	}
+	unsigned char const *const map = mmap(NULL, st.st_size, PROT_READ,
+			MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		DEBUG("Failed to map log %s", path);
+		return NULL;
+	}
+	if (memcmp(map, LOG_MAGIC, sizeof(LOG_MAGIC)) ||
+			get_le(map + 8, 4) != LOG_VERSION ||
+			get_le(map + 12, 4) != AHRS_LOG_BLOCK_SIZE)
+	{
+		DEBUG("%s is not a compatible log.", path);
+		munmap((void *)map, st.st_size);
+		return NULL;
+	}
+
+	struct ahrs_log_reader *const r = calloc(1, sizeof(*r));
+	if (!r)
+	{
+		munmap((void *)map, st.st_size);
+		return NULL;
+	}
+	r->map = map;
+	r->size = st.st_size;
+
+	// Use the index if it is intact, else all whole blocks are searchable
+	unsigned char const *const end = map + r->size;
+	if (r->size >= AHRS_LOG_BLOCK_SIZE + 16 &&
+			!memcmp(end - 8, INDEX_MAGIC, sizeof(INDEX_MAGIC)))
+	{
+		uint64_t const nblocks = get_le(end - 16, 8);
+		// bounded first, so that a corrupt count cannot overflow the sum
+		if (nblocks < r->size / AHRS_LOG_BLOCK_SIZE &&
+				(nblocks + 1) * AHRS_LOG_BLOCK_SIZE + 8 * nblocks + 16 == r->size)
+		{
+			r->nblocks = nblocks;
+			r->index = end - 16 - 8 * nblocks;
+		}
+	}
+	if (!r->index)
+	{
+		DEBUG("Log %s has no index, it may not have been closed.", path);
+		r->nblocks = r->size / AHRS_LOG_BLOCK_SIZE - 1;
+	}
+	ahrs_log_seek(r, 0);
+	return r;
+}
+
+void ahrs_log_reader_close(struct ahrs_log_reader *const r)
+{
+	munmap((void *)r->map, r->size);
+	free(r);
+}
+
+uint64_t ahrs_log_count(struct ahrs_log_reader const *const r)
+{
+	uint64_t n = 0;
+	for (size_t i = 0; i < r->nblocks; ++i)
+	{
+		n += get_le(block_at(r, i) + 16, 4);
+	}
+	return n;
+}
+
+static void position(struct ahrs_log_reader *const r, size_t const block)
+{
+	r->block = block;
+	r->sample = 0;
+	r->next = block_at(r, block) + BLOCK_HEADER_SIZE;
+}
+
+int ahrs_log_next(struct ahrs_log_reader *const r,
+		struct ahrs_sample *const sample)
+{
+	for (;;)
+	{
+		if (r->block >= r->nblocks)
+		{
+			return -1;
+		}
+		unsigned char const *const block = block_at(r, r->block);
+		if (r->sample < get_le(block + 16, 4))
+		{
+			break;
+		}
+		position(r, r->block + 1);
+	}
+
+	unsigned char const *const block = block_at(r, r->block);
+	if (!r->sample)
+	{
+		r->time = get_le(block, 8);
+		for (unsigned i = 0; i < NUM_ATT_AXES; ++i)
+		{
+			r->att[i] = get_le(block + 24 + 2 * i, 2);
+		}
+		r->headingstatus = block[30];
+	}
+	else
+	{
+		uint64_t const nbytes = get_le(block + 20, 4);
+		unsigned char const *const end = block + BLOCK_HEADER_SIZE +
+			(nbytes < AHRS_LOG_BLOCK_SIZE - BLOCK_HEADER_SIZE ? nbytes :
+			 AHRS_LOG_BLOCK_SIZE - BLOCK_HEADER_SIZE);
+		uint64_t val;
+		unsigned n;
+		if (!(n = get_varint(r->next, end, &val)))
+		{
+			DEBUG("Corrupt log block %zu", r->block);
+			return -1;
+		}
+		r->next += n;
+		bool const hs_changed = val & 1U;
+		r->time += val >> 1;
+		for (unsigned i = 0; i < NUM_ATT_AXES; ++i)
+		{
+			if (!(n = get_varint(r->next, end, &val)))
+			{
+				DEBUG("Corrupt log block %zu", r->block);
+				return -1;
+			}
+			r->next += n;
+			r->att[i] += unzigzag(val);
+		}
+		if (hs_changed)
+		{
+			if (r->next >= end)
+			{
+				DEBUG("Corrupt log block %zu", r->block);
+				return -1;
+			}
+			r->headingstatus = *r->next++;
+		}
+	}
+	++r->sample;
+
+	*sample = (struct ahrs_sample){.headingstatus = r->headingstatus,
+		.time = r->time};
+	for (unsigned i = 0; i < NUM_ATT_AXES; ++i)
+	{
+		sample->att[i] = ahrs_bam_to_deg(i, r->att[i]);
+	}
+	return 0;
+}
+
+void ahrs_log_seek(struct ahrs_log_reader *const r, io_ahrs_usec const time)
+{
+	// find the last block starting at or before time
+	size_t lo = 0;
+	size_t hi = r->nblocks;
+	while (hi - lo > 1)
+	{
+		size_t const mid = lo + (hi - lo) / 2;
+		if (block_time(r, mid) <= time)
+		{
+			lo = mid;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	if (!r->nblocks)
+	{
+		position(r, 0);
+		return;
+	}
+	position(r, lo);
+
+	// then decode up to the first sample at or after time
+	for (;;)
+	{
+		struct ahrs_log_reader const prev = *r;
+		struct ahrs_sample sample;
+		if (ahrs_log_next(r, &sample))
+		{
+			return;
+		}
+		if (sample.time >= time)
+		{
+			*r = prev;
+			return;
+		}
+	}
+}
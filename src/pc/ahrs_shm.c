@@ -0,0 +1,256 @@
+#define _POSIX_C_SOURCE 200809L
+#include <assert.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "ahrs_shm.h"
+#include "dbg.h"
+
+
+static_assert((AHRS_SHM_NSLOTS & (AHRS_SHM_NSLOTS - 1)) == 0,
+		"AHRS_SHM_NSLOTS must be a power of 2");
+// Atomics shared between processes must not rely on a per-process lock
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "64 bit atomics must be lock free");
+
+#define AHRS_SHM_MAGIC 0x41485253U // "AHRS"
+
+// Options that change struct ahrs_sample, which can leave its size the same
+// while moving its members, so readers must match the publisher exactly
+#define FEATURE_GYRO (1U << 0)
+#define FEATURE_COMPACT (1U << 1)
+#define FEATURE_CLOCK (1U << 2)
+static uint32_t const FEATURES = 0
+#ifdef AHRS_GYRO
+	| FEATURE_GYRO
+#endif
+#ifdef AHRS_COMPACT
+	| FEATURE_COMPACT
+#endif
+#ifdef AHRS_CLOCK
+	| FEATURE_CLOCK
+#endif
+	;
+
+struct ahrs_shm_slot
+{
+	// 2 * generation of the sample in this slot, plus 1 while it is being
+	// written
+	atomic_uint_least64_t seq;
+	struct ahrs_sample sample;
+};
+
+struct ahrs_shm
+{
+	// Used by readers to check the publisher wrote a compatible layout
+	uint32_t magic;
+	uint32_t nslots;
+	uint32_t sample_size;
+	uint32_t features; // FEATURE_ bits
+	// generation of the newest completely written sample
+	atomic_uint_least64_t head;
+	struct ahrs_shm_slot slot[AHRS_SHM_NSLOTS];
+};
+
+
+static void publish_to(struct ahrs_shm *const shm,
+		struct ahrs_sample const *const sample)
+{
+	// only this thread writes, so the head can be read without ordering
+	uint_least64_t const gen =
+		atomic_load_explicit(&shm->head, memory_order_relaxed) + 1;
+	struct ahrs_shm_slot *const slot = &shm->slot[gen % AHRS_SHM_NSLOTS];
+
+	atomic_store_explicit(&slot->seq, 2 * gen + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	slot->sample = *sample;
+	atomic_store_explicit(&slot->seq, 2 * gen, memory_order_release);
+	atomic_store_explicit(&shm->head, gen, memory_order_release);
+}
+
+static struct ahrs_shm *_Atomic pub;
+static char *pub_name;
+// set while publish() may be using pub, so ahrs_shm_publish_stop() can wait
+// for it to finish before unmapping
+static atomic_bool publishing;
+
+static void publish(struct ahrs_sample const *const sample)
+{
+	// Both sides store their flag and then load the other's, sequentially
+	// consistent, so either this sees pub cleared or the stopper sees
+	// publishing set.
+	atomic_store(&publishing, true);
+	struct ahrs_shm *const shm = atomic_load(&pub);
+	if (shm)
+	{
+		publish_to(shm, sample);
+	}
+	atomic_store_explicit(&publishing, false, memory_order_release);
+}
+
+int ahrs_shm_publish_start(char const *const name)
+{
+	static bool handler_added;
+	if (!handler_added)
+	{
+		if (ahrs_sample_handler_add(publish))
+		{
+			return -1;
+		}
+		handler_added = true;
+	}
+	ahrs_shm_publish_stop();
+
+	char *const name_copy = strdup(name);
+	if (!name_copy)
+	{
+		DEBUG("Out of memory copying %s", name);
+		return -1;
+	}
+
+	// Start from an empty segment, in case a stale one was left behind
+	shm_unlink(name);
+	int const fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+	if (fd == -1)
+	{
+		DEBUG("Failed to create shared memory object %s", name);
+		free(name_copy);
+		return -1;
+	}
+	if (ftruncate(fd, sizeof(struct ahrs_shm)) == -1)
+	{
+		DEBUG("Failed to size shared memory object %s", name);
+		close(fd);
+		shm_unlink(name);
+		free(name_copy);
+		return -1;
+	}
+	struct ahrs_shm *const shm = mmap(NULL, sizeof(struct ahrs_shm),
+			PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd); // the mapping keeps the object open
+	if (shm == MAP_FAILED)
+	{
+		DEBUG("Failed to map shared memory object %s", name);
+		shm_unlink(name);
+		free(name_copy);
+		return -1;
+	}
+
+	// ftruncate zero-fills, so every seq and head are already 0
+	shm->nslots = AHRS_SHM_NSLOTS;
+	shm->sample_size = sizeof(struct ahrs_sample);
+	shm->features = FEATURES;
+	// Readers check magic last, so it must be written after the rest
+	atomic_thread_fence(memory_order_release);
+	shm->magic = AHRS_SHM_MAGIC;
+
+	pub_name = name_copy;
+	atomic_store(&pub, shm);
+	return 0;
+}
+
+void ahrs_shm_publish_stop()
+{
+	struct ahrs_shm *const shm = atomic_exchange(&pub, NULL);
+	if (!shm)
+	{
+		return;
+	}
+	// The receive thread may still be in publish() with the old pointer, so
+	// the mapping may only go once it is out. That takes no longer than
+	// copying one sample.
+	while (atomic_load(&publishing))
+	{
+		sched_yield();
+	}
+	munmap(shm, sizeof(struct ahrs_shm));
+	shm_unlink(pub_name);
+	free(pub_name);
+	pub_name = NULL;
+	return;
+}
+
+struct ahrs_shm const *ahrs_shm_open(char const *const name)
+{
+	int const fd = shm_open(name, O_RDONLY, 0);
+	if (fd == -1)
+	{
+		DEBUG("Failed to open shared memory object %s", name);
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size != sizeof(struct ahrs_shm))
+	{
+		DEBUG("Shared memory object %s has the wrong size.", name);
+		close(fd);
+		return NULL;
+	}
+	struct ahrs_shm const *const shm = mmap(NULL, sizeof(struct ahrs_shm),
+			PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED)
+	{
+		DEBUG("Failed to map shared memory object %s", name);
+		return NULL;
+	}
+	if (shm->magic != AHRS_SHM_MAGIC || shm->nslots != AHRS_SHM_NSLOTS ||
+			shm->sample_size != sizeof(struct ahrs_sample) ||
+			shm->features != FEATURES)
+	{
+		DEBUG("Shared memory object %s has an incompatible layout.", name);
+		munmap((void *)shm, sizeof(struct ahrs_shm));
+		return NULL;
+	}
+	atomic_thread_fence(memory_order_acquire);
+	return shm;
+}
+
+void ahrs_shm_close(struct ahrs_shm const *const shm)
+{
+	munmap((void *)shm, sizeof(struct ahrs_shm));
+	return;
+}
+
+int ahrs_shm_get(struct ahrs_shm const *const shm, uint64_t const gen,
+		struct ahrs_sample *const sample)
+{
+	// The atomics are never written through this pointer, but C11 doesn't
+	// allow loads from const atomics
+	struct ahrs_shm_slot *const slot =
+		(void *)&shm->slot[gen % AHRS_SHM_NSLOTS];
+
+	if (gen == 0 ||
+			atomic_load_explicit(&slot->seq, memory_order_acquire) != 2 * gen)
+	{
+		return -1;
+	}
+	*sample = slot->sample;
+	// sample reads may not be reordered after the sequence is rechecked
+	atomic_thread_fence(memory_order_acquire);
+	if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != 2 * gen)
+	{
+		return -1; // overwritten during the copy
+	}
+	return 0;
+}
+
+uint64_t ahrs_shm_latest(struct ahrs_shm const *const shm,
+		struct ahrs_sample *const sample)
+{
+	atomic_uint_least64_t *const head = (void *)&shm->head;
+	for (;;)
+	{
+		uint64_t const gen = atomic_load_explicit(head, memory_order_acquire);
+		// Only fails if the publisher lapped the whole ring during the copy
+		if (gen == 0 || !ahrs_shm_get(shm, gen, sample))
+		{
+			return gen;
+		}
+	}
+}
@@ -0,0 +1,153 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "dlog.h"
+
+
+#ifndef DLOG_LEN
+#define DLOG_LEN 256U
+#endif
+// How often the drain thread formats what was recorded
+#ifndef DLOG_DRAIN_NSEC
+#define DLOG_DRAIN_NSEC 100000000L
+#endif
+
+/*
+ * A bounded queue with a sequence number per slot, so any thread can record
+ * without a lock. For the lap = 2 * (position / DLOG_LEN) that a slot is
+ * being used for, its seq is lap while free, and lap + 1 once recorded.
+ */
+static struct
+{
+	atomic_size_t seq;
+	struct dlog_site const *site;
+	long a, b;
+} ring[DLOG_LEN];
+static atomic_size_t head;
+static size_t tail; // only drained under drain_lock
+static atomic_ulong dropped;
+
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t drain_once = PTHREAD_ONCE_INIT;
+static int drain_err;
+
+static void *drain_thread(void *const arg)
+{
+	(void)arg;
+	for (;;)
+	{
+		nanosleep(&(struct timespec){.tv_nsec = DLOG_DRAIN_NSEC}, NULL);
+		dlog_drain(stderr);
+	}
+	return NULL;
+}
+
+static void drain_at_exit()
+{
+	dlog_drain(stderr);
+}
+
+static void drain_start()
+{
+	// Started with every signal blocked, so that it inherits that mask and
+	// never takes a signal meant for a thread of the application.
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	pthread_t thread;
+	drain_err = pthread_create(&thread, NULL, drain_thread, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (drain_err)
+	{
+		fprintf(stderr, "DEBUG %s:%d: Failed starting the dlog drain thread.\n",
+				__FILE__, __LINE__);
+		return;
+	}
+	pthread_detach(thread);
+	atexit(drain_at_exit);
+}
+
+int dlog_init()
+{
+	pthread_once(&drain_once, drain_start);
+	return drain_err ? -1 : 0;
+}
+
+void dlog_record(struct dlog_site const *const site, long const a,
+		long const b)
+{
+	size_t pos = atomic_load_explicit(&head, memory_order_relaxed);
+	for (;;)
+	{
+		size_t const lap = pos / DLOG_LEN * 2;
+		size_t const seq = atomic_load_explicit(&ring[pos % DLOG_LEN].seq,
+				memory_order_acquire);
+		if (seq == lap)
+		{
+			if (atomic_compare_exchange_weak_explicit(&head, &pos, pos + 1,
+					memory_order_relaxed, memory_order_relaxed))
+			{
+				break;
+			}
+		}
+		else if (seq < lap)
+		{
+			// not yet drained from the previous lap
+			atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+			return;
+		}
+		else
+		{
+			// claimed by another thread
+			pos = atomic_load_explicit(&head, memory_order_relaxed);
+		}
+	}
+
+	unsigned const i = pos % DLOG_LEN;
+	ring[i].site = site;
+	ring[i].a = a;
+	ring[i].b = b;
+	atomic_store_explicit(&ring[i].seq, pos / DLOG_LEN * 2 + 1,
+			memory_order_release);
+}
+
+size_t dlog_drain(FILE *const out)
+{
+	pthread_mutex_lock(&drain_lock);
+	size_t n = 0;
+	for (;; ++n, ++tail)
+	{
+		unsigned const i = tail % DLOG_LEN;
+		size_t const lap = tail / DLOG_LEN * 2;
+		if (atomic_load_explicit(&ring[i].seq, memory_order_acquire) !=
+				lap + 1)
+		{
+			// empty, or still being recorded
+			break;
+		}
+		struct dlog_site const *const site = ring[i].site;
+		long const a = ring[i].a, b = ring[i].b;
+		atomic_store_explicit(&ring[i].seq, lap + 2, memory_order_release);
+
+		fprintf(out, "DEBUG %s:%d: ", site->file, site->line);
+		fprintf(out, site->fmt, a, b);
+		fprintf(out, "\n");
+	}
+	unsigned long const lost =
+		atomic_exchange_explicit(&dropped, 0, memory_order_relaxed);
+	if (lost)
+	{
+		fprintf(out, "DEBUG %s:%d: %lu messages dropped.\n", __FILE__,
+				__LINE__, lost);
+	}
+	if (n || lost)
+	{
+		fflush(out);
+	}
+	pthread_mutex_unlock(&drain_lock);
+	return n;
+}
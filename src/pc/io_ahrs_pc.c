@@ -1,11 +1,24 @@
-#define _POSIX_C_SOURCE 1
+#define _GNU_SOURCE // for pthread_attr_setaffinity_np
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <unistd.h>
 #include <assert.h>
+#include <stdatomic.h>
 
 #include "io_ahrs.h"
 #include "macrodef.h"
 #include "dbg.h"
+#include "trace.h"
+#include "dlog.h"
 
 
 FILE *io_ahrs;
@@ -14,14 +27,48 @@ static pthread_t thread_recv;
 
 static int (*handler_recv)();
 
+static char *device_path; // for reopening
+
+/*
+ * What the receive thread last read from the device, per io_ahrs_getc_chunk
+ */
+static struct
+{
+	// room for the stdio buffer of io_ahrs, and whatever arrives while
+	// take_buffered() drains it
+	unsigned char data[8192];
+	size_t pos, n;
+	bool end, error; // of the last read
+} rx;
+
+#define BACKOFF_MIN_USEC 10000U
+#define BACKOFF_MAX_USEC 1000000U
+
+static struct
+{
+	bool enabled;
+	struct io_ahrs_reconnect_opts opts;
+	pthread_mutex_t lock; // of stats
+	struct io_ahrs_conn_stats stats;
+} conn = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
 
 void io_ahrs_init(char const *path)
 {
+	// before anything received could be logged
+	dlog_init();
 	io_ahrs = fopen(path, "r+");
 	if (!io_ahrs)
 	{
 		DEBUG("Failed to open %s", path);
+		return;
 	}
+	free(device_path);
+	device_path = strdup(path);
+	pthread_mutex_lock(&conn.lock);
+	conn.stats.state = IO_AHRS_CONNECTED;
+	conn.stats.since = io_ahrs_time();
+	pthread_mutex_unlock(&conn.lock);
 	// TODO: correctly handle termios
 	return;
 }
@@ -32,12 +79,189 @@ void io_ahrs_clean()
 	return;
 }
 
+int io_ahrs_reconnect_set(struct io_ahrs_reconnect_opts const *const opts)
+{
+	if (!device_path)
+	{
+		DEBUG("No device to reconnect to. io_ahrs_init must succeed first.");
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fileno(io_ahrs), &st) || !S_ISCHR(st.st_mode))
+	{
+		DEBUG("%s is not a character device, so can't be reconnected to.",
+				device_path);
+		return -1;
+	}
+	conn.opts = *opts;
+	if (!conn.opts.backoff_min)
+	{
+		conn.opts.backoff_min = BACKOFF_MIN_USEC;
+	}
+	if (!conn.opts.backoff_max)
+	{
+		conn.opts.backoff_max = BACKOFF_MAX_USEC;
+	}
+	if (conn.opts.backoff_min > conn.opts.backoff_max)
+	{
+		DEBUG("Reconnect backoff_min exceeds backoff_max.");
+		return -1;
+	}
+	conn.enabled = true;
+	return 0;
+}
+
+void io_ahrs_conn_stats(struct io_ahrs_conn_stats *const stats)
+{
+	pthread_mutex_lock(&conn.lock);
+	*stats = conn.stats;
+	pthread_mutex_unlock(&conn.lock);
+}
+
+/*
+ * Enters state at now, accounting for an outage that began at lost, and
+ * reports it.
+ */
+static void conn_state_set(enum io_ahrs_conn const state,
+		io_ahrs_usec const now, io_ahrs_usec const lost)
+{
+	pthread_mutex_lock(&conn.lock);
+	if (conn.stats.state == IO_AHRS_CONNECTED)
+	{
+		++conn.stats.losses;
+	}
+	else if (state == IO_AHRS_CONNECTED)
+	{
+		io_ahrs_usec const downtime = now - lost;
+		conn.stats.last_downtime = downtime;
+		if (downtime > conn.stats.max_downtime)
+		{
+			conn.stats.max_downtime = downtime;
+		}
+		conn.stats.total_downtime += downtime;
+	}
+	conn.stats.state = state;
+	conn.stats.since = now;
+	struct io_ahrs_conn_stats const stats = conn.stats;
+	pthread_mutex_unlock(&conn.lock);
+
+	if (conn.opts.state_changed)
+	{
+		conn.opts.state_changed(&stats);
+	}
+}
+
+/*
+ * Starts rx with what is in the stdio buffer of io_ahrs, eg bytes read
+ * past the end of the response to a command, so that none are skipped when
+ * reading the device directly.
+ */
+static void take_buffered()
+{
+	rx.pos = rx.n = 0;
+	rx.end = rx.error = false;
+	// Reading nonblocking drains the buffer without waiting for more.
+	int const fd = fileno(io_ahrs);
+	int const flags = fcntl(fd, F_GETFL);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+	{
+		return;
+	}
+	int c;
+	while (rx.n < sizeof(rx.data) && (c = getc(io_ahrs)) != EOF)
+	{
+		rx.data[rx.n++] = c;
+	}
+	clearerr(io_ahrs);
+	fcntl(fd, F_SETFL, flags);
+}
+
+/*
+ * Closes the device, leaving /dev/null in its place, so that io_ahrs stays
+ * a valid stream on which commands just fail.
+ */
+static void close_device()
+{
+	FILE *const null = fopen("/dev/null", "r+");
+	if (!null)
+	{
+		DEBUG("Failed to open /dev/null, so %s stays open.", device_path);
+		return;
+	}
+	fclose(io_ahrs);
+	io_ahrs = null;
+}
+
+/*
+ * Reopens device_path until it is open and conn.opts.reconnect succeeds,
+ * waiting longer between each attempt.
+ */
+static void reconnect()
+{
+	io_ahrs_usec const lost = io_ahrs_time();
+	conn_state_set(IO_AHRS_DISCONNECTED, lost, lost);
+	io_ahrs_usec backoff = conn.opts.backoff_min;
+	for (;;)
+	{
+		FILE *const file = fopen(device_path, "r+");
+		if (file)
+		{
+			// Not cancellable until io_ahrs is usable again, so that
+			// io_ahrs_recv_stop() never leaves it closed or half configured
+			int cancel_state;
+			pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancel_state);
+			fclose(io_ahrs);
+			io_ahrs = file;
+			conn_state_set(IO_AHRS_CONFIGURING, io_ahrs_time(), lost);
+			bool const ok = !conn.opts.reconnect || !conn.opts.reconnect();
+			conn_state_set(ok ? IO_AHRS_CONNECTED : IO_AHRS_DISCONNECTED,
+					io_ahrs_time(), lost);
+			if (ok)
+			{
+				take_buffered();
+			}
+			else
+			{
+				close_device();
+			}
+			pthread_setcancelstate(cancel_state, NULL);
+			if (ok)
+			{
+				return;
+			}
+		}
+		nanosleep(&(struct timespec){
+				.tv_sec = backoff / 1000000U,
+				.tv_nsec = backoff % 1000000U * 1000}, NULL);
+		backoff = backoff > conn.opts.backoff_max / 2 ?
+			conn.opts.backoff_max : backoff * 2;
+	}
+}
+
 static void *ahrs_recv_thread(void *arg)
 {
 	(void)arg;
 	for (;;)
 	{
-		if (handler_recv() == EOF && feof(io_ahrs))
+		// so that errno only tells of a failure of this read
+		errno = 0;
+		if (handler_recv() != EOF)
+		{
+			continue;
+		}
+		// per io_ahrs_getc_chunk(), or stdio if the handler reads io_ahrs
+		bool const end = rx.end || feof(io_ahrs);
+		bool const error = rx.error || ferror(io_ahrs);
+		rx.end = rx.error = false;
+		if (ferror(io_ahrs) && errno == EINTR)
+		{
+			clearerr(io_ahrs);
+		}
+		else if (conn.enabled && (end || error))
+		{
+			reconnect();
+		}
+		else if (end)
 		{
 			return NULL;
 		}
@@ -47,15 +271,201 @@ static void *ahrs_recv_thread(void *arg)
 int io_ahrs_recv_start(int (*handler)())
 {
 	handler_recv = handler;
+	take_buffered();
 	return pthread_create(&thread_recv, NULL, ahrs_recv_thread, NULL);
 }
 
+/*
+ * Sets up attr per opts.
+ *
+ * returns 0 on success, or an errno value
+ */
+static int recv_attr_init(pthread_attr_t *const attr,
+		struct io_ahrs_recv_opts const *const opts)
+{
+	int err;
+	if (opts->priority)
+	{
+		struct sched_param const param = {.sched_priority = opts->priority};
+		if ((err = pthread_attr_setinheritsched(attr, PTHREAD_EXPLICIT_SCHED)) ||
+				(err = pthread_attr_setschedpolicy(attr, SCHED_FIFO)) ||
+				(err = pthread_attr_setschedparam(attr, &param)))
+		{
+			DEBUG("Invalid SCHED_FIFO priority %d", opts->priority);
+			return err;
+		}
+	}
+
+	if (opts->cpus)
+	{
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		for (unsigned i = 0; i < 64; ++i)
+		{
+			if (opts->cpus & (UINT64_C(1) << i))
+			{
+				CPU_SET(i, &cpus);
+			}
+		}
+		if ((err = pthread_attr_setaffinity_np(attr, sizeof(cpus), &cpus)))
+		{
+			DEBUG("Invalid cpu affinity mask %#llx",
+					(unsigned long long)opts->cpus);
+			return err;
+		}
+	}
+
+	if (opts->stack)
+	{
+		if ((err = pthread_attr_setstack(attr, opts->stack, opts->stack_size)))
+		{
+			DEBUG("Invalid receive thread stack of size %zu", opts->stack_size);
+			return err;
+		}
+		// Also faults in every page, so none fault on first use
+		if (!opts->mlockall && mlock(opts->stack, opts->stack_size))
+		{
+			err = errno;
+			DEBUG("Failed to lock receive thread stack. Needs CAP_IPC_LOCK or a higher RLIMIT_MEMLOCK.");
+			return err;
+		}
+	}
+	else if (opts->stack_size &&
+			(err = pthread_attr_setstacksize(attr, opts->stack_size)))
+	{
+		DEBUG("Invalid receive thread stack size %zu", opts->stack_size);
+		return err;
+	}
+	return 0;
+}
+
+/*
+ * Undoes what io_ahrs_recv_start_opts() locked in memory per opts, for a
+ * receive thread that never ran.
+ */
+static void recv_unlock(struct io_ahrs_recv_opts const *const opts)
+{
+	if (opts->mlockall)
+	{
+		munlockall();
+	}
+	else if (opts->stack)
+	{
+		munlock(opts->stack, opts->stack_size);
+	}
+}
+
+int io_ahrs_recv_start_opts(int (*handler)(),
+		struct io_ahrs_recv_opts const *const opts)
+{
+	// Lock first, so the thread's own stack is locked as it is created
+	if (opts->mlockall && mlockall(MCL_CURRENT | MCL_FUTURE))
+	{
+		int const err = errno;
+		DEBUG("Failed to lock process memory. Needs CAP_IPC_LOCK or a higher RLIMIT_MEMLOCK.");
+		return err;
+	}
+
+	pthread_attr_t attr;
+	int err;
+	if ((err = pthread_attr_init(&attr)))
+	{
+		recv_unlock(opts);
+		return err;
+	}
+	if ((err = recv_attr_init(&attr, opts)))
+	{
+		pthread_attr_destroy(&attr);
+		recv_unlock(opts);
+		return err;
+	}
+
+	handler_recv = handler;
+	take_buffered();
+	err = pthread_create(&thread_recv, &attr, ahrs_recv_thread, NULL);
+	pthread_attr_destroy(&attr);
+	if (err == EPERM)
+	{
+		DEBUG("Not permitted to use SCHED_FIFO priority %d. Needs CAP_SYS_NICE or a higher RLIMIT_RTPRIO.",
+				opts->priority);
+	}
+	if (err)
+	{
+		recv_unlock(opts);
+	}
+	return err;
+}
+
 void io_ahrs_recv_stop()
 {
 	pthread_cancel(thread_recv);
+	// so that io_ahrs can be used as soon as this returns
+	pthread_join(thread_recv, NULL);
 	return;
 }
 
+io_ahrs_usec io_ahrs_time()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (io_ahrs_usec)ts.tv_sec * 1000000U + ts.tv_nsec / 1000;
+}
+
+int io_ahrs_getc_chunk(bool *const chunk)
+{
+	*chunk = rx.pos == rx.n;
+	if (*chunk)
+	{
+		ssize_t n;
+		while ((n = read(fileno(io_ahrs), rx.data, sizeof(rx.data))) ==
+				-1 && errno == EINTR)
+		{
+		}
+		if (n <= 0)
+		{
+			rx.pos = rx.n = 0;
+			rx.end = !n;
+			rx.error = n;
+			return EOF;
+		}
+		rx.pos = 0;
+		rx.n = n;
+	}
+	return rx.data[rx.pos++];
+}
+
+int io_ahrs_getc_timeout(io_ahrs_usec const timeout)
+{
+	// Reading nonblocking makes getc report EOF with EAGAIN once the stdio
+	// buffer is drained, rather than blocking, so that poll can do the
+	// waiting without missing already buffered bytes.
+	int const fd = fileno(io_ahrs);
+	int const flags = fcntl(fd, F_GETFL);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1)
+	{
+		return EOF;
+	}
+
+	io_ahrs_usec const deadline = io_ahrs_time() + timeout;
+	int c;
+	while ((c = getc(io_ahrs)) == EOF && ferror(io_ahrs) &&
+			(errno == EAGAIN || errno == EWOULDBLOCK))
+	{
+		clearerr(io_ahrs);
+		io_ahrs_usec const now = io_ahrs_time();
+		if (now >= deadline)
+		{
+			break;
+		}
+		struct pollfd pfd = {.fd = fd, .events = POLLIN};
+		// round up, so as not to spin for the last fraction of a ms
+		poll(&pfd, 1, (deadline - now + 999) / 1000);
+	}
+
+	fcntl(fd, F_SETFL, flags);
+	return c;
+}
+
 static struct
 {
 	unsigned char write : 2;
@@ -86,11 +496,16 @@ bool io_ahrs_tripbuf_update()
 		updated = false;
 	}
 	pthread_mutex_unlock(&tripbuf.lock);
+	if (updated)
+	{
+		TRACE(TRACE_UPDATE);
+	}
 	return updated;
 }
 
 void io_ahrs_tripbuf_offer()
 {
+	TRACE(TRACE_OFFER);
 	pthread_mutex_lock(&tripbuf.lock);
 
 	assert(IN_RANGE(0, tripbuf.write, 2) && IN_RANGE(0, tripbuf.clean, 2) &&
@@ -113,3 +528,59 @@ unsigned char io_ahrs_tripbuf_read()
 {
 	return tripbuf.read;
 }
+
+// odd while the writer is changing the data it guards
+static atomic_uint seqlock;
+
+void io_ahrs_seqlock_write_begin()
+{
+	unsigned const seq = atomic_load_explicit(&seqlock, memory_order_relaxed);
+	atomic_store_explicit(&seqlock, seq + 1, memory_order_relaxed);
+	// data writes may not be reordered before the sequence becoming odd
+	atomic_thread_fence(memory_order_release);
+}
+
+void io_ahrs_seqlock_write_end()
+{
+	unsigned const seq = atomic_load_explicit(&seqlock, memory_order_relaxed);
+	atomic_store_explicit(&seqlock, seq + 1, memory_order_release);
+}
+
+unsigned io_ahrs_seqlock_read_begin()
+{
+	unsigned seq;
+	while ((seq = atomic_load_explicit(&seqlock, memory_order_acquire)) & 1U)
+	{
+		// writer is mid-copy, which is only ever a few dozen bytes
+	}
+	return seq;
+}
+
+bool io_ahrs_seqlock_read_retry(unsigned const seq)
+{
+	// data reads may not be reordered after the sequence is rechecked
+	atomic_thread_fence(memory_order_acquire);
+	return atomic_load_explicit(&seqlock, memory_order_relaxed) != seq;
+}
+
+static atomic_uint queue_head, queue_tail;
+
+unsigned io_ahrs_queue_head()
+{
+	return atomic_load_explicit(&queue_head, memory_order_acquire);
+}
+
+void io_ahrs_queue_head_set(unsigned const head)
+{
+	atomic_store_explicit(&queue_head, head, memory_order_release);
+}
+
+unsigned io_ahrs_queue_tail()
+{
+	return atomic_load_explicit(&queue_tail, memory_order_acquire);
+}
+
+void io_ahrs_queue_tail_set(unsigned const tail)
+{
+	atomic_store_explicit(&queue_tail, tail, memory_order_release);
+}
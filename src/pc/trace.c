@@ -0,0 +1,53 @@
+#ifdef AHRS_TRACE
+#define _POSIX_C_SOURCE 200809L
+#include <stdatomic.h>
+#include <time.h>
+
+#include "trace.h"
+
+
+#ifndef AHRS_TRACE_NREC
+#define AHRS_TRACE_NREC 65536U // must be a power of 2
+#endif
+
+// Both the receive thread and the consumer record, so slots are claimed
+// atomically
+static struct trace_rec ring[AHRS_TRACE_NREC];
+static atomic_uint_fast64_t head;
+
+void trace_record(enum trace_point const point)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	uint_fast64_t const i =
+		atomic_fetch_add_explicit(&head, 1, memory_order_relaxed);
+	ring[i % AHRS_TRACE_NREC] = (struct trace_rec){
+		.ns = (uint64_t)ts.tv_sec * 1000000000U + ts.tv_nsec,
+		.point = point};
+}
+
+int trace_dump(FILE *const file)
+{
+	uint_fast64_t const end = atomic_load(&head);
+	uint_fast64_t const begin =
+		end > AHRS_TRACE_NREC ? end - AHRS_TRACE_NREC : 0;
+	uint64_t const count = end - begin;
+
+	if (fwrite(TRACE_MAGIC, sizeof(TRACE_MAGIC), 1, file) != 1 ||
+			fwrite(&count, sizeof(count), 1, file) != 1)
+	{
+		return -1;
+	}
+	for (uint_fast64_t i = begin; i < end; ++i)
+	{
+		if (fwrite(&ring[i % AHRS_TRACE_NREC], sizeof(ring[0]), 1, file) != 1)
+		{
+			return -1;
+		}
+	}
+	return fflush(file) ? -1 : 0;
+}
+#else
+// ISO C forbids an empty translation unit
+typedef int trace_disabled;
+#endif
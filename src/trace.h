@@ -0,0 +1,57 @@
+#ifndef trace_h
+#define trace_h
+
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Tracepoints along the path of a sample, from the ahrs to the consumer, for
+ * profiling where the latency goes. They are compiled in only when AHRS_TRACE
+ * is defined, and otherwise cost nothing. pc only.
+ *
+ * Each TRACE() records the tracepoint and a nanosecond timestamp in a
+ * lock-free ring of the most recent AHRS_TRACE_NREC records, which
+ * trace_dump() writes out for util/trace_report.
+ */
+enum trace_point
+{
+	TRACE_CHUNK, // first byte of a newly arrived chunk was read
+	TRACE_SYNC, // a datagram header was synchronized with
+	TRACE_CRC, // a datagram passed its crc
+	TRACE_OFFER, // io_ahrs_tripbuf_offer() was called
+	TRACE_UPDATE, // io_ahrs_tripbuf_update() returned true
+	NUM_TRACE_POINTS
+};
+
+// Dumped record, in native byte order
+struct trace_rec
+{
+	uint64_t ns; // CLOCK_MONOTONIC
+	uint32_t point; // enum trace_point
+	uint32_t reserved;
+};
+
+#define TRACE_MAGIC "AHRSTRC" // followed by a u64 count of records
+
+#ifdef AHRS_TRACE
+#ifdef AVR
+#error "AHRS_TRACE is only supported on pc."
+#endif
+
+#define TRACE(point) trace_record(point)
+
+void trace_record(enum trace_point point);
+
+/**
+ * Writes the recorded tracepoints to file, oldest first, preceded by
+ * TRACE_MAGIC and their count. Should be called after tracing has stopped,
+ * since records being written concurrently may be torn.
+ *
+ * returns 0 on success
+ */
+int trace_dump(FILE *file);
+#else
+#define TRACE(point)
+#endif
+
+#endif
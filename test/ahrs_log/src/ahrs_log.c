@@ -0,0 +1,204 @@
+/**
+ * Purpose: Check that samples written to an ahrs_log read back as written,
+ * per ahrs_log.h.
+ *
+ * Usage: make check, or ahrs_log
+ *
+ * Writes a log of generated samples to a temporary file, and checks that
+ * reading it back gives the same samples, that seeking finds the first
+ * sample at or after each time, and that a log whose index is corrupt or
+ * missing can still be read. Prints each failed check and exits with 1 if
+ * any failed, or with 0 if all passed.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "ahrs.h"
+#include "ahrs_log.h"
+
+
+static unsigned failures;
+
+#define CHECK(cond) \
+	do \
+	{ \
+		if (!(cond)) \
+		{ \
+			fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__, #cond); \
+			++failures; \
+		} \
+	} while (0)
+
+#define NUM_SAMPLES 20000U
+
+static struct ahrs_sample expected[NUM_SAMPLES];
+
+/*
+ * Fills expected with samples that exercise the delta encoding: irregular
+ * time steps with a long gap, angles that wrap, and occasional heading
+ * status changes.
+ */
+static void generate()
+{
+	io_ahrs_usec time = 1000;
+	for (unsigned i = 0; i < NUM_SAMPLES; ++i)
+	{
+		time += 10000 + i % 7 + (i == NUM_SAMPLES / 2 ? 60000000 : 0);
+		expected[i] = (struct ahrs_sample){
+			.att = {
+				[PITCH] = 80.f * sinf(i * .001f),
+				[YAW] = fmodf(i * .37f, 360.f),
+				[ROLL] = (i % 3000 < 1500 ? 1.f : -1.f) * (i % 1500) * .12f},
+			.headingstatus = 1 + i / 1000 % 3,
+			.time = time};
+	}
+}
+
+/*
+ * returns whether sample is expected[i] to the resolution of the log
+ */
+static bool same(struct ahrs_sample const *const sample, unsigned const i)
+{
+	for (unsigned j = 0; j < NUM_ATT_AXES; ++j)
+	{
+		if (ahrs_deg_to_bam(sample->att[j]) !=
+				ahrs_deg_to_bam(expected[i].att[j]))
+		{
+			return false;
+		}
+	}
+	return sample->headingstatus == expected[i].headingstatus &&
+		sample->time == expected[i].time;
+}
+
+/*
+ * returns the index of the first of the n samples of decoded with a time at
+ * or after time, or n if there is none
+ */
+static size_t first_at(struct ahrs_sample const *const decoded,
+		size_t const n, io_ahrs_usec const time)
+{
+	size_t lo = 0;
+	size_t hi = n;
+	while (lo < hi)
+	{
+		size_t const mid = lo + (hi - lo) / 2;
+		if (decoded[mid].time < time)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/*
+ * Reads the log at path in full and by seeking, checking that it holds
+ * nkept of the samples of expected in order.
+ */
+static void check_read(char const *const path, uint64_t const nkept)
+{
+	struct ahrs_log_reader *const reader = ahrs_log_open(path);
+	CHECK(reader);
+	if (!reader)
+	{
+		return;
+	}
+	CHECK(ahrs_log_count(reader) == nkept);
+
+	static struct ahrs_sample decoded[NUM_SAMPLES];
+	size_t n = 0;
+	unsigned i = 0;
+	struct ahrs_sample sample;
+	while (n < NUM_SAMPLES && !ahrs_log_next(reader, &sample))
+	{
+		// samples the disk fell behind on are missing, never altered
+		while (i < NUM_SAMPLES && expected[i].time < sample.time)
+		{
+			++i;
+		}
+		CHECK(i < NUM_SAMPLES && same(&sample, i));
+		decoded[n++] = sample;
+	}
+	CHECK(n == nkept);
+
+	io_ahrs_usec const last = expected[NUM_SAMPLES - 1].time;
+	for (io_ahrs_usec time = 0; time <= last + 1; time += last / 997)
+	{
+		ahrs_log_seek(reader, time);
+		size_t const at = first_at(decoded, n, time);
+		if (at == n)
+		{
+			CHECK(ahrs_log_next(reader, &sample));
+			continue;
+		}
+		CHECK(!ahrs_log_next(reader, &sample));
+		CHECK(sample.time == decoded[at].time);
+	}
+	ahrs_log_seek(reader, last + 1);
+	CHECK(ahrs_log_next(reader, &sample));
+	ahrs_log_reader_close(reader);
+}
+
+int main()
+{
+	char path[] = "/tmp/ahrs_log.XXXXXX";
+	int const fd = mkstemp(path);
+	if (fd == -1)
+	{
+		perror(path);
+		return 1;
+	}
+	close(fd);
+
+	generate();
+	struct ahrs_log *const log = ahrs_log_create(path);
+	CHECK(log);
+	if (!log)
+	{
+		unlink(path);
+		return 1;
+	}
+	for (unsigned i = 0; i < NUM_SAMPLES; ++i)
+	{
+		CHECK(!ahrs_log_write(log, &expected[i]));
+	}
+	uint64_t const nkept = NUM_SAMPLES - ahrs_log_dropped(log);
+	CHECK(!ahrs_log_close(log));
+
+	check_read(path, nkept);
+
+	// A number of blocks in the index trailer far too large for the file
+	FILE *const file = fopen(path, "r+b");
+	CHECK(file);
+	if (file)
+	{
+		unsigned char const huge[8] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+			0xFF, 0x0F};
+		CHECK(!fseek(file, -16, SEEK_END));
+		CHECK(fwrite(huge, sizeof(huge), 1, file) == 1);
+		CHECK(!fseek(file, 0, SEEK_END));
+		long const size = ftell(file);
+		CHECK(!fclose(file));
+		check_read(path, nkept);
+
+		// A log that was never closed, without an index
+		CHECK(!truncate(path, size - size % AHRS_LOG_BLOCK_SIZE));
+		check_read(path, nkept);
+	}
+	unlink(path);
+
+	if (failures)
+	{
+		fprintf(stderr, "%u checks failed.\n", failures);
+		return 1;
+	}
+	printf("All checks passed.\n");
+	return 0;
+}
@@ -0,0 +1,147 @@
+/**
+ * Purpose: Check that telemetry frames decode back to what was encoded, and
+ * that the decoder resyncs on a noisy stream, per ahrs_telem.h.
+ *
+ * Usage: make check, or ahrs_telem
+ *
+ * Encodes a sequence of frames into a stream, with some frames dropped, some
+ * corrupted, some cut short, and debug text between them, and checks that
+ * the decoder finds exactly the intact frames, in order, and counts the
+ * corrupt ones. Prints each failed check and exits with 1 if any failed, or
+ * with 0 if all passed.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "ahrs.h"
+#include "ahrs_telem.h"
+
+
+static unsigned failures;
+
+#define CHECK(cond) \
+	do \
+	{ \
+		if (!(cond)) \
+		{ \
+			fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__, #cond); \
+			++failures; \
+		} \
+	} while (0)
+
+#define NUM_FRAMES 1000U
+
+// Frames that don't arrive intact
+#define DROPPED(i) ((i) % 50 == 7)
+#define CORRUPTED(i) ((i) % 100 == 13)
+#define CUT_SHORT(i) ((i) % 100 == 61)
+
+static struct ahrs_compact frame(unsigned const i)
+{
+	return (struct ahrs_compact){
+		.att = {
+			[PITCH] = (uint16_t)(i * 37U),
+			[YAW] = (uint16_t)(i * 65U + 11U),
+			[ROLL] = (uint16_t)(0U - i * 13U)},
+		.headingstatus = 1 + i % 3,
+		.seq = (uint8_t)i};
+}
+
+static bool same(struct ahrs_compact const *const a,
+		struct ahrs_compact const *const b)
+{
+	return !memcmp(a->att, b->att, sizeof(a->att)) &&
+		a->headingstatus == b->headingstatus && a->seq == b->seq;
+}
+
+int main()
+{
+	// A single frame, and the same again byte by byte
+	struct ahrs_telem_decoder decoder = {0};
+	struct ahrs_compact const one = frame(42);
+	unsigned char buf[AHRS_TELEM_SIZE];
+	ahrs_telem_encode(&one, buf);
+	struct ahrs_compact got;
+	unsigned ndecoded = 0;
+	for (unsigned r = 0; r < 2; ++r)
+	{
+		for (unsigned j = 0; j < AHRS_TELEM_SIZE; ++j)
+		{
+			if (ahrs_telem_decode(&decoder, buf[j], &got))
+			{
+				CHECK(j == AHRS_TELEM_SIZE - 1);
+				CHECK(same(&got, &one));
+				++ndecoded;
+			}
+		}
+	}
+	CHECK(ndecoded == 2);
+	CHECK(!decoder.bad_crc);
+
+	// A noisy stream
+	static unsigned char stream[NUM_FRAMES * (AHRS_TELEM_SIZE + 32)];
+	size_t n = 0;
+	unsigned nexpected = 0, nbad = 0;
+	for (unsigned i = 0; i < NUM_FRAMES; ++i)
+	{
+		if (i % 10 == 3)
+		{
+			// debug text, including bytes that begin a frame header
+			static char const text[] = "dbg: \0\r\n";
+			memcpy(stream + n, text, sizeof(text) - 1);
+			n += sizeof(text) - 1;
+		}
+		if (DROPPED(i))
+		{
+			continue;
+		}
+		struct ahrs_compact const compact = frame(i);
+		ahrs_telem_encode(&compact, stream + n);
+		if (CORRUPTED(i))
+		{
+			stream[n + 6] ^= 0x10U;
+			++nbad;
+		}
+		else if (CUT_SHORT(i))
+		{
+			n += AHRS_TELEM_SIZE / 2;
+			// fails its crc with the start of the next frame
+			++nbad;
+			continue;
+		}
+		else
+		{
+			++nexpected;
+		}
+		n += AHRS_TELEM_SIZE;
+	}
+
+	decoder = (struct ahrs_telem_decoder){0};
+	unsigned i = 0;
+	ndecoded = 0;
+	for (size_t j = 0; j < n; ++j)
+	{
+		if (!ahrs_telem_decode(&decoder, stream[j], &got))
+		{
+			continue;
+		}
+		while (i < NUM_FRAMES && (DROPPED(i) || CORRUPTED(i) || CUT_SHORT(i)))
+		{
+			++i;
+		}
+		struct ahrs_compact const want = frame(i++);
+		CHECK(same(&got, &want));
+		++ndecoded;
+	}
+	CHECK(ndecoded == nexpected);
+	CHECK(decoder.bad_crc == nbad);
+
+	if (failures)
+	{
+		fprintf(stderr, "%u checks failed.\n", failures);
+		return 1;
+	}
+	printf("All checks passed.\n");
+	return 0;
+}
@@ -1,7 +1,8 @@
 #include <stdio.h>
-#include <inttypes.h>
 
 #include "ahrs.h"
+#include "ahrs_telem.h"
+#include "dlog.h"
 #include "io_ahrs.h"
 #include "io.h"
 
@@ -22,10 +23,16 @@ int main (int argc, char *argv[])
 	{
 		if (ahrs_att_update())
 		{
-			printf("P: %f\tR: %f\tY: %f HS: %" PRIuFAST8 "\r", ahrs_att(PITCH),
-					ahrs_att(ROLL), ahrs_att(YAW), ahrs_headingstatus());
-			fflush(stdout);
+			// Relayed as binary telemetry frames, decoded on the host with
+			// util/telem_decode, rather than formatted as text
+			struct ahrs_compact compact;
+			ahrs_att_compact(&compact);
+			unsigned char frame[AHRS_TELEM_SIZE];
+			ahrs_telem_encode(&compact, frame);
+			fwrite(frame, 1, sizeof(frame), stdout);
 		}
+		// messages recorded by the parser and the usart interrupt
+		dlog_drain(stderr);
 	}
 	return 0;
 }
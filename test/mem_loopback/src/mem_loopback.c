@@ -0,0 +1,191 @@
+/**
+ * Purpose: Check the parser and the commands against the in-memory io_ahrs,
+ * without a device, per io_ahrs_mem.h.
+ *
+ * Usage: make check, or mem_loopback
+ *
+ * Feeds datagrams to the parser and checks what it makes of them, and runs
+ * commands against a generator that answers them, checking the bytes they
+ * wrote. Prints each failed check and exits with 1 if any failed, or with 0
+ * if all passed.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "ahrs.h"
+#include "crc_xmodem.h"
+#include "dlog.h"
+#include "io_ahrs.h"
+#include "io_ahrs_mem.h"
+
+
+static unsigned failures;
+
+#define CHECK(cond) \
+	do \
+	{ \
+		if (!(cond)) \
+		{ \
+			fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__, #cond); \
+			++failures; \
+		} \
+	} while (0)
+
+/*
+ * Appends the datagram of the n byte frame (frame ID and payload) to buf,
+ * with its byte count and crc.
+ *
+ * returns the number of bytes appended
+ */
+static size_t datagram(unsigned char *const buf,
+		unsigned char const *const frame, size_t const n)
+{
+	size_t const count = n + 4;
+	buf[0] = count >> 8;
+	buf[1] = count & 0xFF;
+	memcpy(buf + 2, frame, n);
+	uint16_t crc = CRC_XMODEM_INIT_VAL;
+	for (size_t i = 0; i < count - 2; ++i)
+	{
+		crc = crc_xmodem_update(crc, buf[i]);
+	}
+	buf[count - 2] = crc >> 8;
+	buf[count - 1] = crc & 0xFF;
+	return count;
+}
+
+static void put_float(unsigned char *const buf, float const value)
+{
+	uint32_t u;
+	memcpy(&u, &value, sizeof(u));
+	for (unsigned i = 0; i < 4; ++i)
+	{
+		buf[i] = u >> (24 - 8 * i);
+	}
+}
+
+/*
+ * Appends a kGetDataResp datagram with the data components parse_att()
+ * expects to buf.
+ *
+ * returns the number of bytes appended
+ */
+static size_t data_resp(unsigned char *const buf, float const yaw,
+		float const pitch, float const roll, uint8_t const headingstatus)
+{
+	unsigned char frame[64] = {5, 4}; // kGetDataResp, component count
+	size_t n = 2;
+	frame[n++] = 5; // kHeading
+	put_float(frame + n, yaw);
+	n += 4;
+	frame[n++] = 24; // kPitch
+	put_float(frame + n, pitch);
+	n += 4;
+	frame[n++] = 25; // kRoll
+	put_float(frame + n, roll);
+	n += 4;
+	frame[n++] = 79; // kHeadingStatus
+	frame[n++] = headingstatus;
+#ifdef AHRS_GYRO
+	frame[1] += 3;
+	for (unsigned char id = 74; id <= 76; ++id) // kGyroX, kGyroY, kGyroZ
+	{
+		frame[n++] = id;
+		put_float(frame + n, 0.f);
+		n += 4;
+	}
+#endif
+	return datagram(buf, frame, n);
+}
+
+static void check_parse()
+{
+	unsigned char buf[512];
+	size_t n = data_resp(buf, 10.f, 20.f, 30.f, 1);
+	n += data_resp(buf + n, 40.f, -50.f, 60.f, 2);
+	// a corrupted datagram is dropped and doesn't hold up the next
+	size_t const bad = n;
+	n += data_resp(buf + n, 70.f, 80.f, 90.f, 1);
+	buf[bad + 6] ^= 0x01;
+	n += data_resp(buf + n, 100.f, 10.f, -170.f, 3);
+
+	unsigned long const generation = ahrs_att_snapshot(&(struct ahrs_sample){0});
+	io_ahrs_mem_source(buf, n);
+	io_ahrs_recv_start(ahrs_att_recv);
+	CHECK(io_ahrs_mem_pump(0) == n);
+	io_ahrs_recv_stop();
+
+	CHECK(ahrs_att_update());
+	CHECK(ahrs_att(YAW) == 100.f);
+	CHECK(ahrs_att(PITCH) == 10.f);
+	CHECK(ahrs_att(ROLL) == -170.f);
+	CHECK(!ahrs_att_update());
+
+	struct ahrs_sample sample;
+	CHECK(ahrs_att_snapshot(&sample) == generation + 3);
+	CHECK(sample.headingstatus == 3);
+}
+
+/*
+ * Answers kSave with kSaveDone once the command has been written in full
+ */
+static size_t answer_save(unsigned char *const buf, size_t const n,
+		void *const arg)
+{
+	bool *const answered = arg;
+	size_t written;
+	unsigned char const *const capture = io_ahrs_mem_capture(&written);
+	if (*answered || written < 5 || capture[2] != 9 || n < 7)
+	{
+		return 0;
+	}
+	*answered = true;
+	return datagram(buf, (unsigned char const[]){16, 0, 0}, 3); // kSaveDone
+}
+
+static void check_commands()
+{
+	unsigned char expected[16];
+	size_t written;
+	unsigned char const *capture;
+
+	io_ahrs_mem_capture_clear();
+	CHECK(ahrs_cont_start() == 0);
+	capture = io_ahrs_mem_capture(&written);
+	size_t n = datagram(expected, (unsigned char const[]){21}, 1);
+	CHECK(written == n && !memcmp(capture, expected, n));
+
+	io_ahrs_mem_capture_clear();
+	bool answered = false;
+	io_ahrs_mem_source_gen(answer_save, &answered);
+	CHECK(ahrs_save() == 0);
+	CHECK(answered);
+	capture = io_ahrs_mem_capture(&written);
+	n = datagram(expected, (unsigned char const[]){9}, 1);
+	CHECK(written == n && !memcmp(capture, expected, n));
+
+	// and without an answer, it times out on the simulated clock
+	io_ahrs_mem_source(NULL, 0);
+	io_ahrs_usec const start = io_ahrs_time();
+	CHECK(ahrs_save() == -1);
+	CHECK(io_ahrs_time() != start);
+}
+
+int main()
+{
+	io_ahrs_init("mem");
+	check_parse();
+	check_commands();
+	io_ahrs_clean();
+	// the messages of the failures checked for
+	dlog_drain(stdout);
+
+	if (failures)
+	{
+		fprintf(stderr, "%u checks failed.\n", failures);
+		return 1;
+	}
+	printf("All checks passed.\n");
+	return 0;
+}
@@ -0,0 +1,615 @@
+/**
+ * Purpose: Own the ahrs and share its samples and configuration with any
+ * number of local processes over a Unix domain socket, per ahrsd.h.
+ *
+ * Usage: ahrsd [-s] [-r] [-t TRACE_FILE] DEVICE SOCKET
+ *
+ * DEVICE is opened with io_ahrs_init(), so it may also be a pty or a fifo
+ * replaying a capture. With -s, the ahrs is brought up with ahrs_start()
+ * first; otherwise it is assumed to be sending already. SOCKET is replaced if
+ * it exists. Exits on SIGINT or SIGTERM.
+ *
+ * With -r, which DEVICE must be a tty for, losing DEVICE, eg when a usb
+ * serial adapter resets, doesn't end receiving. DEVICE is instead reopened
+ * until it comes back, and with -s the ahrs is brought up again with
+ * ahrs_reconnect(). Each change of connection state is reported on stderr,
+ * along with how long the outage lasted.
+ *
+ * -t is only available with the library and ahrsd both built with AHRS_TRACE
+ * defined, eg with CPPFLAGS_pc=-DAHRS_TRACE and CPPFLAGS=-DAHRS_TRACE. The
+ * tracepoints recorded until exit are then written to TRACE_FILE with
+ * trace_dump(), for util/trace_report. ahrsd takes samples with a sample
+ * handler rather than ahrs_att_update(), so there are no TRACE_UPDATE ones.
+ *
+ * The receive thread hands each sample to the daemon thread through a lock
+ * free ring and an eventfd. The daemon thread serves everything else from a
+ * single epoll loop, and sends each subscriber every sample due to it since
+ * the last wakeup with one writev. A client that falls behind has samples
+ * dropped rather than holding up the others. While a configuration command
+ * is exchanged with the ahrs, the receive thread is stopped, so no samples
+ * are received.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "ahrs.h"
+#include "ahrsd.h"
+#include "io_ahrs.h"
+#include "trace.h"
+
+
+#ifdef AHRS_TRACE
+#define TRACE_OPTION "t:"
+#define TRACE_USAGE " [-t TRACE_FILE]"
+#else
+#define TRACE_OPTION ""
+#define TRACE_USAGE ""
+#endif
+
+#define RING_LEN 1024U // must be a power of 2
+#define MAX_CLIENTS 64U
+#define START_USEC 10000000U
+
+// epoll data of the fds other than clients, which are by index
+enum
+{
+	EV_LISTEN = MAX_CLIENTS,
+	EV_SAMPLE,
+	EV_SIGNAL
+};
+
+/*
+ * Samples from the receive thread to the daemon thread. The indices count
+ * samples, wrapping.
+ */
+static struct ahrsd_sample ring[RING_LEN];
+static atomic_uint ring_head, ring_tail;
+// samples not put in the ring because it was full
+static atomic_uint ring_dropped;
+static int sample_fd; // eventfd signalled for each sample
+
+static struct client
+{
+	int fd; // -1 if unused
+	bool subscribed;
+	uint32_t interval;
+	uint64_t due;
+	uint32_t dropped;
+} clients[MAX_CLIENTS];
+
+/*
+ * Sample handler, on the receive thread
+ */
+static void on_sample(struct ahrs_sample const *const sample)
+{
+	unsigned const head =
+		atomic_load_explicit(&ring_head, memory_order_relaxed);
+	if (head - atomic_load_explicit(&ring_tail, memory_order_acquire) ==
+			RING_LEN)
+	{
+		// the daemon thread is hopelessly behind, so every client would drop
+		// it anyway, and is told so by drain()
+		atomic_fetch_add_explicit(&ring_dropped, 1, memory_order_relaxed);
+		return;
+	}
+	struct ahrsd_sample *const s = &ring[head % RING_LEN];
+	*s = (struct ahrsd_sample){
+		.time = sample->time,
+		.headingstatus = sample->headingstatus};
+	memcpy(s->att, sample->att, sizeof(s->att));
+	atomic_store_explicit(&ring_head, head + 1, memory_order_release);
+
+	uint64_t const one = 1;
+	if (write(sample_fd, &one, sizeof(one)) != sizeof(one))
+	{
+		perror("write eventfd");
+	}
+}
+
+static void client_close(struct client *const client)
+{
+	close(client->fd);
+	client->fd = -1;
+}
+
+/*
+ * Sends msg of n bytes to client, closing it if it has gone away
+ */
+static void client_send(struct client *const client, void const *const msg,
+		size_t const n)
+{
+	if (send(client->fd, msg, n, MSG_NOSIGNAL) == -1 &&
+			errno != EAGAIN && errno != EWOULDBLOCK)
+	{
+		client_close(client);
+	}
+}
+
+static void send_status(struct client *const client, uint8_t const request,
+		int32_t const result)
+{
+	struct ahrsd_status const status = {
+		.type = AHRSD_STATUS,
+		.request = request,
+		.result = result};
+	client_send(client, &status, sizeof(status));
+}
+
+/*
+ * Sends the count samples pointed to by iov[1..count] to client in one
+ * AHRSD_SAMPLES message. iov[0] is filled in with the header.
+ */
+static void send_samples(struct client *const client, struct iovec *const iov,
+		size_t const count)
+{
+	struct ahrsd_samples const header = {
+		.type = AHRSD_SAMPLES,
+		.count = count,
+		.dropped = client->dropped};
+	iov[0] = (struct iovec){.iov_base = (void *)&header,
+		.iov_len = sizeof(header)};
+	if (writev(client->fd, iov, count + 1) == -1)
+	{
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+		{
+			client->dropped += count; // its socket buffer is full
+		}
+		else
+		{
+			client_close(client);
+		}
+		return;
+	}
+	client->dropped = 0;
+}
+
+/*
+ * Delivers the n samples in batch to each subscriber they are due to
+ */
+static void deliver(struct ahrsd_sample *const batch, size_t const n)
+{
+	static struct iovec iov[1 + AHRSD_BATCH_MAX];
+	for (unsigned c = 0; c < MAX_CLIENTS; ++c)
+	{
+		struct client *const client = &clients[c];
+		size_t count = 0;
+		for (size_t i = 0; i < n && client->fd != -1 && client->subscribed;
+				++i)
+		{
+			if (client->interval)
+			{
+				if (batch[i].time < client->due)
+				{
+					continue;
+				}
+				client->due = batch[i].time + client->interval;
+			}
+			iov[1 + count++] = (struct iovec){.iov_base = &batch[i],
+				.iov_len = sizeof(batch[i])};
+			if (count == AHRSD_BATCH_MAX)
+			{
+				send_samples(client, iov, count);
+				count = 0;
+			}
+		}
+		if (count && client->fd != -1)
+		{
+			send_samples(client, iov, count);
+		}
+	}
+}
+
+/*
+ * Takes every sample from the ring and delivers them
+ */
+static void drain()
+{
+	uint64_t nevents;
+	if (read(sample_fd, &nevents, sizeof(nevents)) != sizeof(nevents))
+	{
+		return;
+	}
+	static struct ahrsd_sample batch[RING_LEN];
+	unsigned const tail =
+		atomic_load_explicit(&ring_tail, memory_order_relaxed);
+	unsigned const n =
+		atomic_load_explicit(&ring_head, memory_order_acquire) - tail;
+	for (unsigned i = 0; i < n; ++i)
+	{
+		batch[i] = ring[(tail + i) % RING_LEN];
+	}
+	atomic_store_explicit(&ring_tail, tail + n, memory_order_release);
+
+	// Which of them would have been due to which client isn't known, so
+	// they are counted against every subscriber.
+	unsigned const overflow =
+		atomic_exchange_explicit(&ring_dropped, 0, memory_order_relaxed);
+	for (unsigned c = 0; overflow && c < MAX_CLIENTS; ++c)
+	{
+		if (clients[c].fd != -1 && clients[c].subscribed)
+		{
+			clients[c].dropped += overflow;
+		}
+	}
+	deliver(batch, n);
+}
+
+/*
+ * Runs a command exchanged with the ahrs, which needs the receive thread
+ * stopped meanwhile.
+ */
+static int configure(int (*const command)(void *), void *const arg)
+{
+	io_ahrs_recv_stop();
+	int const result = command(arg);
+	ahrs_parse_att_reset();
+	if (io_ahrs_recv_start(ahrs_att_recv))
+	{
+		fprintf(stderr, "Failed to restart the receive thread.\n");
+		exit(-1);
+	}
+	return result;
+}
+
+static int set_acq_params(void *const params)
+{
+	return ahrs_set_acq_params(params);
+}
+
+static int get_acq_params(void *const params)
+{
+	return ahrs_get_acq_params(params);
+}
+
+static int save(void *const arg)
+{
+	(void)arg;
+	return ahrs_save();
+}
+
+static void handle_request(struct client *const client)
+{
+	union
+	{
+		struct ahrsd_header header;
+		struct ahrsd_subscribe subscribe;
+		struct ahrsd_acq_params acq_params;
+	} req;
+	ssize_t const n = recv(client->fd, &req, sizeof(req), MSG_TRUNC);
+	if (n <= 0)
+	{
+		if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+		{
+			client_close(client);
+		}
+		return;
+	}
+
+	uint8_t const type = req.header.type;
+	switch (type)
+	{
+		case AHRSD_SUBSCRIBE:
+			if (n != sizeof(req.subscribe))
+			{
+				break;
+			}
+			client->subscribed = true;
+			client->interval = req.subscribe.interval;
+			client->due = 0;
+			client->dropped = 0;
+			send_status(client, type, 0);
+			return;
+		case AHRSD_UNSUBSCRIBE:
+			if (n != sizeof(req.header))
+			{
+				break;
+			}
+			client->subscribed = false;
+			send_status(client, type, 0);
+			return;
+		case AHRSD_GET_LATEST:
+		{
+			if (n != sizeof(req.header))
+			{
+				break;
+			}
+			struct ahrs_sample latest;
+			struct ahrsd_sample sample = {0};
+			struct iovec iov[2] = {[1] = {.iov_base = &sample,
+				.iov_len = sizeof(sample)}};
+			// The drops are still to be reported in the stream, not in the
+			// answer, nor added to if the answer can't be sent.
+			uint32_t const dropped = client->dropped;
+			client->dropped = 0;
+			if (ahrs_att_snapshot(&latest))
+			{
+				sample.time = latest.time;
+				memcpy(sample.att, latest.att, sizeof(sample.att));
+				sample.headingstatus = latest.headingstatus;
+				send_samples(client, iov, 1);
+			}
+			else
+			{
+				send_samples(client, iov, 0);
+			}
+			client->dropped = dropped;
+			return;
+		}
+		case AHRSD_SET_ACQ_PARAMS:
+		{
+			if (n != sizeof(req.acq_params))
+			{
+				break;
+			}
+			struct ahrs_acq_params params = {
+				.polled = req.acq_params.polled,
+				.flush_filter = req.acq_params.flush_filter,
+				.sample_delay = req.acq_params.sample_delay};
+			send_status(client, type, configure(set_acq_params, &params));
+			return;
+		}
+		case AHRSD_GET_ACQ_PARAMS:
+		{
+			if (n != sizeof(req.header))
+			{
+				break;
+			}
+			struct ahrs_acq_params params;
+			if (configure(get_acq_params, &params))
+			{
+				send_status(client, type, -1);
+				return;
+			}
+			struct ahrsd_acq_params const resp = {
+				.type = AHRSD_ACQ_PARAMS,
+				.polled = params.polled,
+				.flush_filter = params.flush_filter,
+				.sample_delay = params.sample_delay};
+			client_send(client, &resp, sizeof(resp));
+			return;
+		}
+		case AHRSD_SAVE:
+			if (n != sizeof(req.header))
+			{
+				break;
+			}
+			send_status(client, type, configure(save, NULL));
+			return;
+		default:
+			break;
+	}
+	send_status(client, type, -1);
+}
+
+static int listen_on(char const *const path)
+{
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+	if (strlen(path) >= sizeof(addr.sun_path))
+	{
+		fprintf(stderr, "Socket path %s is too long.\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	int const fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK |
+			SOCK_CLOEXEC, 0);
+	unlink(path);
+	if (fd == -1 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+			listen(fd, SOMAXCONN))
+	{
+		perror(path);
+		return -1;
+	}
+	return fd;
+}
+
+static int epoll_add(int const epoll_fd, int const fd, uint32_t const data)
+{
+	struct epoll_event ev = {.events = EPOLLIN, .data.u32 = data};
+	return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static void accept_client(int const epoll_fd, int const listen_fd)
+{
+	int const fd = accept4(listen_fd, NULL, NULL,
+			SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd == -1)
+	{
+		return;
+	}
+	for (unsigned c = 0; c < MAX_CLIENTS; ++c)
+	{
+		if (clients[c].fd == -1)
+		{
+			clients[c] = (struct client){.fd = fd};
+			if (epoll_add(epoll_fd, fd, c))
+			{
+				client_close(&clients[c]);
+			}
+			return;
+		}
+	}
+	fprintf(stderr, "Too many clients, refusing another.\n");
+	close(fd);
+}
+
+
+/*
+ * Connection state handler, on the receive thread
+ */
+static void on_conn_state(struct io_ahrs_conn_stats const *const stats)
+{
+	static char const *const names[] = {
+		[IO_AHRS_CONNECTED] = "connected",
+		[IO_AHRS_DISCONNECTED] = "disconnected",
+		[IO_AHRS_CONFIGURING] = "configuring"};
+	if (stats->state == IO_AHRS_CONNECTED)
+	{
+		fprintf(stderr, "ahrs %s after %.3f s down (%lu losses, longest "
+				"%.3f s).\n", names[stats->state],
+				stats->last_downtime / 1e6, stats->losses,
+				stats->max_downtime / 1e6);
+	}
+	else
+	{
+		fprintf(stderr, "ahrs %s.\n", names[stats->state]);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	bool start = false, reconnect = false;
+	char const *trace_path = NULL;
+	int opt;
+	while ((opt = getopt(argc, argv, "sr" TRACE_OPTION)) != -1)
+	{
+		if (opt == 's')
+		{
+			start = true;
+		}
+		else if (opt == 'r')
+		{
+			reconnect = true;
+		}
+		else if (opt == 't')
+		{
+			trace_path = optarg;
+		}
+		else
+		{
+			break;
+		}
+	}
+	if (argc - optind != 2)
+	{
+		fprintf(stderr, "Usage: %s [-s] [-r]" TRACE_USAGE " DEVICE SOCKET\n",
+				argv[0]);
+		return -1;
+	}
+	char const *const device = argv[optind];
+	char const *const socket_path = argv[optind + 1];
+
+	for (unsigned c = 0; c < MAX_CLIENTS; ++c)
+	{
+		clients[c].fd = -1;
+	}
+
+	// Handled by signalfd, and blocked before the receive thread is
+	// created so that it inherits the mask.
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	int const epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	int const signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+	sample_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	int const listen_fd = listen_on(socket_path);
+	if (epoll_fd == -1 || signal_fd == -1 || sample_fd == -1 ||
+			listen_fd == -1 || epoll_add(epoll_fd, listen_fd, EV_LISTEN) ||
+			epoll_add(epoll_fd, sample_fd, EV_SAMPLE) ||
+			epoll_add(epoll_fd, signal_fd, EV_SIGNAL))
+	{
+		perror("ahrsd");
+		return -1;
+	}
+
+	io_ahrs_init(device);
+	if (!io_ahrs)
+	{
+		return -1;
+	}
+	if (start && ahrs_start(START_USEC, false))
+	{
+		fprintf(stderr, "The ahrs didn't start.\n");
+		return -1;
+	}
+	struct io_ahrs_reconnect_opts const reconnect_opts = {
+		.reconnect = start ? ahrs_reconnect : NULL,
+		.state_changed = on_conn_state};
+	if (ahrs_sample_handler_add(on_sample) ||
+			(reconnect && io_ahrs_reconnect_set(&reconnect_opts)) ||
+			io_ahrs_recv_start(ahrs_att_recv))
+	{
+		fprintf(stderr, "Failed to start receiving.\n");
+		return -1;
+	}
+
+	for (bool running = true; running;)
+	{
+		struct epoll_event events[16];
+		int const nevents = epoll_wait(epoll_fd, events, 16, -1);
+		if (nevents == -1 && errno != EINTR)
+		{
+			perror("epoll_wait");
+			break;
+		}
+		for (int i = 0; i < nevents; ++i)
+		{
+			uint32_t const data = events[i].data.u32;
+			if (data == EV_LISTEN)
+			{
+				accept_client(epoll_fd, listen_fd);
+			}
+			else if (data == EV_SAMPLE)
+			{
+				drain();
+			}
+			else if (data == EV_SIGNAL)
+			{
+				running = false;
+			}
+			else if (clients[data].fd != -1)
+			{
+				// closing the fd removes it from the epoll set
+				if (events[i].events & (EPOLLHUP | EPOLLERR))
+				{
+					client_close(&clients[data]);
+				}
+				else
+				{
+					handle_request(&clients[data]);
+				}
+			}
+		}
+	}
+
+	io_ahrs_recv_stop();
+	int ret = 0;
+#ifdef AHRS_TRACE
+	if (trace_path)
+	{
+		FILE *const trace = fopen(trace_path, "wb");
+		if (!trace || trace_dump(trace))
+		{
+			perror(trace_path);
+			ret = -1;
+		}
+		if (trace && fclose(trace))
+		{
+			perror(trace_path);
+			ret = -1;
+		}
+	}
+#else
+	(void)trace_path;
+#endif
+	io_ahrs_clean();
+	unlink(socket_path);
+	return ret;
+}
@@ -0,0 +1,96 @@
+#ifndef AHRSD_H
+#define AHRSD_H
+
+#include <stdint.h>
+
+/*
+ * Protocol between ahrsd and its clients, over a SOCK_SEQPACKET Unix domain
+ * socket, so that each message is exactly one packet. Values are in native
+ * byte order, since both ends are on the same machine. Every message begins
+ * with its type, and requests of the wrong size are answered with a failed
+ * AHRSD_STATUS.
+ */
+enum ahrsd_msg
+{
+	// client to ahrsd
+
+	// struct ahrsd_subscribe. Samples then arrive in AHRSD_SAMPLES messages.
+	// Subscribing again changes the interval.
+	AHRSD_SUBSCRIBE = 1,
+	AHRSD_UNSUBSCRIBE, // struct ahrsd_header
+	// struct ahrsd_header, answered with AHRSD_SAMPLES holding the newest
+	// sample, or none if none has been received yet
+	AHRSD_GET_LATEST,
+	// struct ahrsd_acq_params, per ahrs_set_acq_params(), answered with
+	// AHRSD_STATUS
+	AHRSD_SET_ACQ_PARAMS,
+	// struct ahrsd_header, answered with AHRSD_ACQ_PARAMS, or AHRSD_STATUS
+	// on failure
+	AHRSD_GET_ACQ_PARAMS,
+	// struct ahrsd_header, per ahrs_save(), answered with AHRSD_STATUS
+	AHRSD_SAVE,
+
+	// ahrsd to client
+
+	// struct ahrsd_samples followed by its count of struct ahrsd_sample
+	AHRSD_SAMPLES = 128,
+	AHRSD_STATUS, // struct ahrsd_status
+	AHRSD_ACQ_PARAMS // struct ahrsd_acq_params
+};
+
+// Most samples in one AHRSD_SAMPLES message
+#define AHRSD_BATCH_MAX 256U
+
+struct ahrsd_header
+{
+	uint8_t type;
+	uint8_t reserved[3];
+};
+
+struct ahrsd_subscribe
+{
+	uint8_t type;
+	uint8_t reserved[3];
+	// Least time between samples delivered, in us, delivering the first
+	// received once each has passed. 0 delivers every sample.
+	uint32_t interval;
+};
+
+struct ahrsd_acq_params
+{
+	uint8_t type;
+	uint8_t polled;
+	uint8_t flush_filter;
+	uint8_t reserved;
+	float sample_delay;
+};
+
+struct ahrsd_status
+{
+	uint8_t type;
+	uint8_t request; // type of the request answered
+	uint8_t reserved[2];
+	int32_t result; // 0 on success
+};
+
+struct ahrsd_samples
+{
+	uint8_t type;
+	uint8_t reserved;
+	uint16_t count;
+	// samples due to this client that were dropped since its last
+	// AHRSD_SAMPLES, because it didn't read them in time, or because ahrsd
+	// itself fell behind, in which case every subscriber counts them. 0 in
+	// the answer to AHRSD_GET_LATEST.
+	uint32_t dropped;
+};
+
+struct ahrsd_sample
+{
+	uint64_t time; // us, per io_ahrs_time() of ahrsd
+	float att[3]; // indexed by enum att_axis
+	uint8_t headingstatus;
+	uint8_t reserved[3];
+};
+
+#endif
@@ -0,0 +1,577 @@
+/**
+ * Purpose: Measure how the ahrs datagram parser copes with line noise, by
+ * injecting faults into a clean stream of datagrams and feeding the result
+ * through ahrs_att_feed().
+ *
+ * Usage: fault_inject [-n FRAMES] [-e EVERY] [-s SEED] [-r REPEAT]
+ *                     [-m MODE[,MODE...]] [CAPTURE_FILE]
+ *
+ * The clean stream is CAPTURE_FILE, bytes captured from the ahrs in
+ * continuous mode, or else FRAMES synthetic datagrams (default 100000). A
+ * single fault is injected at a random position within every EVERY-th
+ * datagram (default 8), so that each fault damages exactly one datagram and
+ * the parser can resync in between. MODE is one of
+ *     none      no faults, as a baseline
+ *     flip      a bit is flipped
+ *     drop      a byte is dropped
+ *     insert    a random byte is inserted
+ *     truncate  the rest of the datagram is dropped
+ *     framing   a burst of 1 to 4 bytes with framing errors, each of which
+ *               is either lost, since uart_ahrs_getchar() returns EOF for it,
+ *               or received garbled
+ * and every mode is run by default.
+ *
+ * Prints a header line and then one line of CSV per mode, with
+ *     frames       datagrams in the clean stream
+ *     faults       faults injected
+ *     lost         datagrams of the clean stream that weren't received
+ *     collateral   lost datagrams that had no fault injected into them
+ *     false        datagrams received that weren't in the clean stream
+ *     resync_mean, resync_max
+ *                  bytes from a fault to the start of the next datagram
+ *                  received
+ *     mbyte_per_s  parser throughput over the faulty stream, best of REPEAT
+ *                  (default 5) runs
+ * so that resync strategies can be compared by diffing the output for the
+ * same SEED. Ideally lost equals faults and collateral is 0, meaning a fault
+ * only ever costs the datagram it damaged.
+ *
+ * The parser records every failed datagram with DLOG(), which only stores
+ * a record in a ring until it is drained. Before each line is printed, the
+ * messages of that mode are drained to stderr: the first DLOG_LEN of them,
+ * followed by a count of those dropped. Those recorded by the timed runs
+ * repeat them and are discarded, so each timed run starts with an empty
+ * ring. Redirect stderr for only the CSV, or build the library with
+ * CPPFLAGS_pc=-DNDEBUG to compile the recording out. If it is built
+ * with AHRS_GYRO, build this with the same CPPFLAGS.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ahrs.h"
+#include "crc_xmodem.h"
+#include "dlog.h"
+
+
+enum mode
+{
+	NONE,
+	FLIP,
+	DROP,
+	INSERT,
+	TRUNCATE,
+	FRAMING,
+	NUM_MODES
+};
+
+static char const *const mode_name[NUM_MODES] = {
+	[NONE] = "none",
+	[FLIP] = "flip",
+	[DROP] = "drop",
+	[INSERT] = "insert",
+	[TRUNCATE] = "truncate",
+	[FRAMING] = "framing"};
+
+// A datagram of the clean stream
+struct frame
+{
+	size_t begin, end; // byte offsets, end exclusive
+	struct ahrs_sample sample;
+};
+
+// A byte buffer that grows as needed
+struct buf
+{
+	unsigned char *data;
+	size_t n, cap;
+};
+
+static void put(struct buf *const buf, unsigned char const c)
+{
+	if (buf->n == buf->cap)
+	{
+		buf->cap = buf->cap ? 2 * buf->cap : 4096;
+		if (!(buf->data = realloc(buf->data, buf->cap)))
+		{
+			fprintf(stderr, "Out of memory.\n");
+			exit(-1);
+		}
+	}
+	buf->data[buf->n++] = c;
+}
+
+static void *alloc(size_t const n, size_t const size)
+{
+	void *const p = calloc(n ? n : 1, size);
+	if (!p)
+	{
+		fprintf(stderr, "Out of memory.\n");
+		exit(-1);
+	}
+	return p;
+}
+
+/*
+ * xorshift64*, so runs are reproducible from the seed on any libc
+ */
+static uint64_t rng_state;
+
+static uint32_t rng()
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+	return (rng_state * 0x2545F4914F6CDD1DULL) >> 32;
+}
+
+// returns a random number in [0, n)
+static size_t rng_below(size_t const n)
+{
+	return (size_t)(((uint64_t)rng() * n) >> 32);
+}
+
+static void put_component(struct buf *const buf, uint16_t *const crc,
+		unsigned char const id, float const value)
+{
+	unsigned char bytes[5] = {id};
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	for (unsigned i = 0; i < 4; ++i)
+	{
+		bytes[1 + i] = bits >> (24 - 8 * i);
+	}
+	for (unsigned i = 0; i < sizeof(bytes); ++i)
+	{
+		*crc = crc_xmodem_update(*crc, bytes[i]);
+		put(buf, bytes[i]);
+	}
+}
+
+/*
+ * Appends a kGetDataResp datagram with the components the parser expects,
+ * each with a value unique to frame i.
+ */
+static void put_frame(struct buf *const buf, unsigned long const i)
+{
+#ifdef AHRS_GYRO
+	unsigned char const header[] = {0, 38, 5, 7};
+#else
+	unsigned char const header[] = {0, 23, 5, 4};
+#endif
+	uint16_t crc = CRC_XMODEM_INIT_VAL;
+	for (unsigned j = 0; j < sizeof(header); ++j)
+	{
+		crc = crc_xmodem_update(crc, header[j]);
+		put(buf, header[j]);
+	}
+	put_component(buf, &crc, 5, (float)(i % 36000) / 100); // kHeading
+	put_component(buf, &crc, 24, (float)(i / 36000 % 1800) / 10 - 90); // kPitch
+	put_component(buf, &crc, 25, (float)(i % 3600) / 10 - 180); // kRoll
+	crc = crc_xmodem_update(crc, 79); // kHeadingStatus
+	crc = crc_xmodem_update(crc, i % 3 + 1);
+	put(buf, 79);
+	put(buf, i % 3 + 1);
+#ifdef AHRS_GYRO
+	put_component(buf, &crc, 74, (float)(i % 100) / 100); // kGyroX
+	put_component(buf, &crc, 75, 0); // kGyroY
+	put_component(buf, &crc, 76, 0); // kGyroZ
+#endif
+	put(buf, crc >> 8);
+	put(buf, crc);
+}
+
+static bool read_file(char const *const path, struct buf *const buf)
+{
+	FILE *const file = fopen(path, "rb");
+	if (!file)
+	{
+		fprintf(stderr, "Failed to open %s\n", path);
+		return false;
+	}
+	int c;
+	while ((c = getc(file)) != EOF)
+	{
+		put(buf, c);
+	}
+	fclose(file);
+	return true;
+}
+
+// the sample most recently parsed by ahrs_att_feed()
+static struct ahrs_sample last;
+
+static void handler(struct ahrs_sample const *const sample)
+{
+	last = *sample;
+}
+
+static bool same_sample(struct ahrs_sample const *const a,
+		struct ahrs_sample const *const b)
+{
+	return !memcmp(a->att, b->att, sizeof(a->att)) &&
+		a->headingstatus == b->headingstatus
+#ifdef AHRS_GYRO
+		&& !memcmp(a->gyro, b->gyro, sizeof(a->gyro))
+#endif
+		;
+}
+
+/*
+ * Finds the datagrams in the clean stream by parsing it a byte at a time.
+ *
+ * returns the number of datagrams found
+ */
+static size_t find_frames(struct buf const *const clean,
+		struct frame **const frames)
+{
+	size_t n = 0, cap = 0;
+	*frames = NULL;
+	ahrs_parse_att_reset();
+	for (size_t i = 0; i < clean->n; ++i)
+	{
+		if (!ahrs_att_feed(&clean->data[i], 1))
+		{
+			continue;
+		}
+		if (n == cap)
+		{
+			cap = cap ? 2 * cap : 4096;
+			if (!(*frames = realloc(*frames, cap * sizeof(**frames))))
+			{
+				fprintf(stderr, "Out of memory.\n");
+				exit(-1);
+			}
+		}
+		struct frame *const frame = &(*frames)[n++];
+		frame->end = i + 1;
+		frame->sample = last;
+		// the datagram begins with its big endian byte count
+		frame->begin = n > 1 ? (*frames)[n - 2].end : 0;
+		for (size_t len = 5; len <= frame->end - frame->begin; ++len)
+		{
+			size_t const begin = frame->end - len;
+			if (((size_t)clean->data[begin] << 8 | clean->data[begin + 1]) ==
+					len)
+			{
+				frame->begin = begin;
+				break;
+			}
+		}
+	}
+	return n;
+}
+
+/*
+ * Copies the clean stream to faulty, injecting a fault of the given mode into
+ * every every-th datagram. Stores where each datagram begins and ends in faulty,
+ * and where each fault is.
+ *
+ * returns the number of faults injected
+ */
+static size_t inject(enum mode const mode, struct buf const *const clean,
+		struct frame const *const frames, size_t const nframes,
+		unsigned long const every, struct buf *const faulty,
+		size_t *const begin, size_t *const end, size_t *const fault,
+		bool *const damaged)
+{
+	size_t nfaults = 0;
+	size_t pos = 0; // in clean
+	faulty->n = 0;
+	for (size_t f = 0; f < nframes; ++f)
+	{
+		// bytes between datagrams are kept as is
+		while (pos < frames[f].begin)
+		{
+			put(faulty, clean->data[pos++]);
+		}
+		begin[f] = faulty->n;
+		damaged[f] = mode != NONE && f % every == every / 2;
+		if (!damaged[f])
+		{
+			while (pos < frames[f].end)
+			{
+				put(faulty, clean->data[pos++]);
+			}
+			end[f] = faulty->n;
+			continue;
+		}
+
+		size_t const at = frames[f].begin +
+			rng_below(frames[f].end - frames[f].begin);
+		while (pos < at)
+		{
+			put(faulty, clean->data[pos++]);
+		}
+		fault[nfaults++] = faulty->n;
+		switch (mode)
+		{
+			case FLIP:
+				put(faulty, clean->data[pos++] ^ 1U << rng_below(8));
+				break;
+			case DROP:
+				++pos;
+				break;
+			case INSERT:
+				put(faulty, rng());
+				break;
+			case TRUNCATE:
+				pos = frames[f].end;
+				break;
+			case FRAMING:
+				for (size_t burst = 1 + rng_below(4);
+						burst-- && pos < frames[f].end; ++pos)
+				{
+					if (rng() & 1U)
+					{
+						put(faulty, rng());
+					}
+				}
+				break;
+			default:
+				break;
+		}
+		while (pos < frames[f].end)
+		{
+			put(faulty, clean->data[pos++]);
+		}
+		end[f] = faulty->n;
+	}
+	while (pos < clean->n)
+	{
+		put(faulty, clean->data[pos++]);
+	}
+	return nfaults;
+}
+
+static double now_sec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(enum mode const mode, struct buf const *const clean,
+		struct frame const *const frames, size_t const nframes,
+		unsigned long const every, unsigned long const repeat,
+		unsigned long const seed, FILE *const discard)
+{
+	static struct buf faulty;
+	size_t *const begin = alloc(nframes, sizeof(*begin));
+	size_t *const end = alloc(nframes, sizeof(*end));
+	size_t *const fault = alloc(nframes, sizeof(*fault));
+	bool *const damaged = alloc(nframes, sizeof(*damaged));
+	bool *const received = alloc(nframes, sizeof(*received));
+	// where the datagrams received after each fault begin, in faulty
+	size_t *const resync = alloc(nframes, sizeof(*resync));
+
+	rng_state = seed * 2 + 1;
+	size_t const nfaults = inject(mode, clean, frames, nframes, every, &faulty,
+			begin, end, fault, damaged);
+
+	// Parse a byte at a time, matching each datagram received with the one
+	// of the clean stream that ends at the same position. A damaged datagram
+	// may still be received intact if the fault happened to leave its bytes
+	// as they were, eg when a dropped crc byte equals the one after it, so
+	// it may end a byte early or late.
+	size_t nfalse = 0;
+	size_t f = 0; // the first datagram that could still be received
+	size_t nextfault = 0;
+	ahrs_parse_att_reset();
+	for (size_t i = 0; i < faulty.n; ++i)
+	{
+		if (!ahrs_att_feed(&faulty.data[i], 1))
+		{
+			continue;
+		}
+		while (f < nframes && end[f] < i + 1)
+		{
+			++f;
+		}
+		size_t match;
+		if (f < nframes && (end[f] == i + 1 || damaged[f]) &&
+				same_sample(&last, &frames[f].sample))
+		{
+			match = f++;
+		}
+		else if (f && damaged[f - 1] && !received[f - 1] &&
+				same_sample(&last, &frames[f - 1].sample))
+		{
+			match = f - 1;
+		}
+		else
+		{
+			++nfalse;
+			continue;
+		}
+		received[match] = true;
+		while (nextfault < nfaults && fault[nextfault] <= begin[match])
+		{
+			resync[nextfault++] = begin[match];
+		}
+	}
+
+	size_t nlost = 0, ncollateral = 0;
+	for (size_t j = 0; j < nframes; ++j)
+	{
+		if (!received[j])
+		{
+			++nlost;
+			ncollateral += !damaged[j];
+		}
+	}
+	double resync_sum = 0;
+	size_t resync_max = 0;
+	for (size_t j = 0; j < nextfault; ++j)
+	{
+		size_t const bytes = resync[j] - fault[j];
+		resync_sum += bytes;
+		if (bytes > resync_max)
+		{
+			resync_max = bytes;
+		}
+	}
+
+	dlog_drain(stderr);
+
+	// Time parsing the whole stream at once, as it arrives in chunks when
+	// running.
+	double best = INFINITY;
+	for (unsigned long r = 0; r < repeat; ++r)
+	{
+		dlog_drain(discard);
+		ahrs_parse_att_reset();
+		double const start = now_sec();
+		ahrs_att_feed(faulty.data, faulty.n);
+		double const sec = now_sec() - start;
+		if (sec < best)
+		{
+			best = sec;
+		}
+	}
+	dlog_drain(discard);
+
+	printf("%s,%lu,%zu,%zu,%zu,%zu,%zu,%.1f,%zu,%.1f\n", mode_name[mode],
+			seed, nframes, nfaults, nlost, ncollateral, nfalse,
+			nextfault ? resync_sum / nextfault : 0., resync_max,
+			faulty.n / best / 1e6);
+
+	free(begin);
+	free(end);
+	free(fault);
+	free(damaged);
+	free(received);
+	free(resync);
+}
+
+
+int main(int argc, char *argv[])
+{
+	unsigned long nsynth = 100000, every = 8, seed = 1, repeat = 5;
+	bool run_mode[NUM_MODES] = {false};
+	bool any_mode = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "n:e:s:r:m:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'n':
+				nsynth = strtoul(optarg, NULL, 0);
+				break;
+			case 'e':
+				every = strtoul(optarg, NULL, 0);
+				break;
+			case 's':
+				seed = strtoul(optarg, NULL, 0);
+				break;
+			case 'r':
+				repeat = strtoul(optarg, NULL, 0);
+				break;
+			case 'm':
+				for (char *name = strtok(optarg, ","); name;
+						name = strtok(NULL, ","))
+				{
+					enum mode m = 0;
+					while (m < NUM_MODES && strcmp(name, mode_name[m]))
+					{
+						++m;
+					}
+					if (m == NUM_MODES)
+					{
+						fprintf(stderr, "Unknown mode %s\n", name);
+						return -1;
+					}
+					run_mode[m] = any_mode = true;
+				}
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-n FRAMES] [-e EVERY] [-s SEED] "
+						"[-r REPEAT] [-m MODE[,MODE...]] [CAPTURE_FILE]\n",
+						argv[0]);
+				return -1;
+		}
+	}
+	if (!every || !repeat)
+	{
+		fprintf(stderr, "EVERY and REPEAT must be at least 1.\n");
+		return -1;
+	}
+
+	struct buf clean = {0};
+	if (optind < argc)
+	{
+		if (!read_file(argv[optind], &clean))
+		{
+			return -1;
+		}
+	}
+	else
+	{
+		for (unsigned long i = 0; i < nsynth; ++i)
+		{
+			put_frame(&clean, i);
+		}
+	}
+
+	ahrs_parse_gap_set(0); // bytes are fed faster than they would arrive
+	if (ahrs_sample_handler_add(handler))
+	{
+		return -1;
+	}
+	struct frame *frames;
+	size_t const nframes = find_frames(&clean, &frames);
+	if (!nframes)
+	{
+		fprintf(stderr, "No datagrams found in the clean stream.\n");
+		return -1;
+	}
+
+	FILE *const discard = fopen("/dev/null", "w");
+	if (!discard)
+	{
+		fprintf(stderr, "Failed to open /dev/null\n");
+		return -1;
+	}
+
+	printf("mode,seed,frames,faults,lost,collateral,false,resync_mean,"
+			"resync_max,mbyte_per_s\n");
+	for (enum mode m = 0; m < NUM_MODES; ++m)
+	{
+		if (!any_mode || run_mode[m])
+		{
+			fflush(stdout); // so the messages follow the line before
+			run(m, &clean, frames, nframes, every, repeat, seed, discard);
+		}
+	}
+	fclose(discard);
+	free(frames);
+	free(clean.data);
+	return 0;
+}
@@ -0,0 +1,67 @@
+/**
+ * Purpose: Show the attitude relayed as binary telemetry frames, such as by
+ * test/avr_relay, per ahrs_telem.h.
+ *
+ * Usage: telem_decode [FILE]
+ *
+ * Reads frames from FILE, eg the serial device of the relay or a capture of
+ * it, or else from stdin, and prints one line per valid frame with the
+ * attitude in degrees, the heading status and the sequence number. Other
+ * bytes in the stream, such as debug messages, are skipped. At end of file,
+ * prints to stderr how many frames were received, how many failed their
+ * crc, and how many were missed going by gaps in the sequence numbers.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include "ahrs.h"
+#include "ahrs_telem.h"
+
+
+int main(int argc, char *argv[])
+{
+	if (argc > 2)
+	{
+		fprintf(stderr, "Usage: %s [FILE]\n", argv[0]);
+		return -1;
+	}
+	FILE *const in = argc == 2 ? fopen(argv[1], "rb") : stdin;
+	if (!in)
+	{
+		perror(argv[1]);
+		return -1;
+	}
+
+	struct ahrs_telem_decoder decoder = {0};
+	struct ahrs_compact compact;
+	unsigned long frames = 0, missed = 0;
+	uint8_t seq = 0;
+	int c;
+	while ((c = getc(in)) != EOF)
+	{
+		if (!ahrs_telem_decode(&decoder, c, &compact))
+		{
+			continue;
+		}
+		if (frames++)
+		{
+			missed += (uint8_t)(compact.seq - seq - 1U);
+		}
+		seq = compact.seq;
+		printf("P: %f\tR: %f\tY: %f HS: %" PRIu8 " seq: %" PRIu8 "\n",
+				ahrs_bam_to_deg(PITCH, compact.att[PITCH]),
+				ahrs_bam_to_deg(ROLL, compact.att[ROLL]),
+				ahrs_bam_to_deg(YAW, compact.att[YAW]),
+				compact.headingstatus, compact.seq);
+	}
+	if (ferror(in))
+	{
+		perror(argc == 2 ? argv[1] : "stdin");
+		return -1;
+	}
+
+	fprintf(stderr, "%lu frames, %lu failed crc, at least %lu missed.\n",
+			frames, decoder.bad_crc, missed);
+	return 0;
+}
@@ -0,0 +1,272 @@
+/**
+ * Purpose: Turn a trace written by trace_dump() (in a build with AHRS_TRACE
+ * defined) into per-stage latency histograms, and optionally a Chrome trace
+ * (chrome://tracing or https://ui.perfetto.dev) of every sample.
+ *
+ * Usage: trace_report TRACE_FILE [CHROME_JSON_FILE]
+ *
+ * The stages of a sample are delimited by the tracepoints in trace.h. Since
+ * io_ahrs_tripbuf_update() always makes the most recently offered sample
+ * current, each TRACE_UPDATE is attributed to the last TRACE_OFFER before it.
+ */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+
+enum stage
+{
+	CHUNK_SYNC,
+	SYNC_CRC,
+	CRC_OFFER,
+	OFFER_UPDATE,
+	CHUNK_UPDATE, // the whole path
+	NUM_STAGES
+};
+
+static char const *const stage_name[NUM_STAGES] = {
+	[CHUNK_SYNC] = "chunk -> header sync",
+	[SYNC_CRC] = "header sync -> crc ok",
+	[CRC_OFFER] = "crc ok -> offer",
+	[OFFER_UPDATE] = "offer -> update",
+	[CHUNK_UPDATE] = "chunk -> update (total)"};
+
+#define NBUCKETS 40 // log2 ns buckets, the last up to ~550 s
+
+static struct
+{
+	uint64_t bucket[NBUCKETS];
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t *all; // for percentiles
+	size_t cap;
+} hist[NUM_STAGES];
+
+static FILE *chrome;
+static bool chrome_first = true;
+
+static void add(enum stage const stage, uint64_t const begin,
+		uint64_t const end)
+{
+	uint64_t const ns = end - begin;
+	unsigned b = 0;
+	while (b < NBUCKETS - 1 && ns >> (b + 1))
+	{
+		++b;
+	}
+	++hist[stage].bucket[b];
+	if (hist[stage].count == hist[stage].cap)
+	{
+		hist[stage].cap = hist[stage].cap ? 2 * hist[stage].cap : 1024;
+		hist[stage].all = realloc(hist[stage].all,
+				hist[stage].cap * sizeof(hist[stage].all[0]));
+		if (!hist[stage].all)
+		{
+			fprintf(stderr, "Out of memory.\n");
+			exit(-1);
+		}
+	}
+	hist[stage].all[hist[stage].count++] = ns;
+	hist[stage].sum += ns;
+	if (ns > hist[stage].max)
+	{
+		hist[stage].max = ns;
+	}
+
+	if (chrome && stage != CHUNK_UPDATE)
+	{
+		// the handoff is on the consumer's side, the rest on the receiver's
+		fprintf(chrome, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+				"\"ts\":%.3f,\"dur\":%.3f}", chrome_first ? "" : ",",
+				stage_name[stage], stage == OFFER_UPDATE ? 2 : 1,
+				begin / 1e3, ns / 1e3);
+		chrome_first = false;
+	}
+}
+
+static int cmp_u64(void const *a, void const *b)
+{
+	uint64_t const x = *(uint64_t const *)a;
+	uint64_t const y = *(uint64_t const *)b;
+	return (x > y) - (x < y);
+}
+
+static int cmp_rec(void const *a, void const *b)
+{
+	return cmp_u64(&((struct trace_rec const *)a)->ns,
+			&((struct trace_rec const *)b)->ns);
+}
+
+static uint64_t percentile(enum stage const stage, double const p)
+{
+	return hist[stage].all[(size_t)(p * (hist[stage].count - 1))];
+}
+
+static void print_hist(enum stage const stage)
+{
+	printf("%s: %llu samples", stage_name[stage],
+			(unsigned long long)hist[stage].count);
+	if (!hist[stage].count)
+	{
+		printf("\n\n");
+		return;
+	}
+	qsort(hist[stage].all, hist[stage].count, sizeof(hist[stage].all[0]),
+			cmp_u64);
+	printf(", mean %.1f us, p50 %.1f us, p99 %.1f us, max %.1f us\n",
+			hist[stage].sum / 1e3 / hist[stage].count,
+			percentile(stage, .5) / 1e3, percentile(stage, .99) / 1e3,
+			hist[stage].max / 1e3);
+
+	uint64_t most = 0;
+	for (unsigned b = 0; b < NBUCKETS; ++b)
+	{
+		if (hist[stage].bucket[b] > most)
+		{
+			most = hist[stage].bucket[b];
+		}
+	}
+	for (unsigned b = 0; b < NBUCKETS; ++b)
+	{
+		if (!hist[stage].bucket[b])
+		{
+			continue;
+		}
+		printf("  < %12.3f us %10llu ", (2ULL << b) / 1e3,
+				(unsigned long long)hist[stage].bucket[b]);
+		for (uint64_t i = 0; i < 50 * hist[stage].bucket[b] / most; ++i)
+		{
+			putchar('#');
+		}
+		putchar('\n');
+	}
+	putchar('\n');
+}
+
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2)
+	{
+		fprintf(stderr, "Usage: %s TRACE_FILE [CHROME_JSON_FILE]\n", argv[0]);
+		return -1;
+	}
+
+	FILE *const in = fopen(argv[1], "rb");
+	if (!in)
+	{
+		fprintf(stderr, "Failed to open %s\n", argv[1]);
+		return -1;
+	}
+	char magic[sizeof(TRACE_MAGIC)];
+	uint64_t count;
+	if (fread(magic, sizeof(magic), 1, in) != 1 ||
+			memcmp(magic, TRACE_MAGIC, sizeof(magic)) ||
+			fread(&count, sizeof(count), 1, in) != 1)
+	{
+		fprintf(stderr, "%s is not a trace.\n", argv[1]);
+		return -1;
+	}
+	// Bounded by what the file holds, so a corrupt count can't overflow
+	// the size allocated
+	long const header = ftell(in);
+	long size;
+	if (header == -1 || fseek(in, 0, SEEK_END) || (size = ftell(in)) == -1 ||
+			fseek(in, header, SEEK_SET) ||
+			count > (uint64_t)(size - header) / sizeof(struct trace_rec))
+	{
+		fprintf(stderr, "%s is truncated or not a trace.\n", argv[1]);
+		return -1;
+	}
+	struct trace_rec *const rec = malloc(count * sizeof(*rec) + 1);
+	if (!rec || fread(rec, sizeof(*rec), count, in) != count)
+	{
+		fprintf(stderr, "Failed to read %llu records from %s\n",
+				(unsigned long long)count, argv[1]);
+		return -1;
+	}
+	fclose(in);
+	// records from different threads may be slightly out of order
+	qsort(rec, count, sizeof(*rec), cmp_rec);
+
+	if (argc > 2)
+	{
+		if (!(chrome = fopen(argv[2], "w")))
+		{
+			fprintf(stderr, "Failed to create %s\n", argv[2]);
+			return -1;
+		}
+		fprintf(chrome, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+	}
+
+	// times of the tracepoints of the sample in progress, 0 if not seen
+	uint64_t chunk = 0, sync = 0, crc = 0;
+	// chunk and offer times of the last offered sample
+	uint64_t offer_chunk = 0, offer = 0;
+	for (uint64_t i = 0; i < count; ++i)
+	{
+		uint64_t const ns = rec[i].ns;
+		switch (rec[i].point)
+		{
+			case TRACE_CHUNK:
+				chunk = ns;
+				break;
+			case TRACE_SYNC:
+				if (chunk)
+				{
+					add(CHUNK_SYNC, chunk, ns);
+				}
+				sync = ns;
+				crc = 0;
+				break;
+			case TRACE_CRC:
+				if (sync)
+				{
+					add(SYNC_CRC, sync, ns);
+				}
+				crc = ns;
+				break;
+			case TRACE_OFFER:
+				if (crc)
+				{
+					add(CRC_OFFER, crc, ns);
+				}
+				offer_chunk = sync ? chunk : 0;
+				offer = ns;
+				sync = crc = 0;
+				break;
+			case TRACE_UPDATE:
+				if (offer)
+				{
+					add(OFFER_UPDATE, offer, ns);
+					if (offer_chunk)
+					{
+						add(CHUNK_UPDATE, offer_chunk, ns);
+					}
+				}
+				offer = 0;
+				break;
+			default:
+				fprintf(stderr, "Unknown tracepoint %u\n",
+						(unsigned)rec[i].point);
+		}
+	}
+
+	if (chrome)
+	{
+		fprintf(chrome, "\n]}\n");
+		fclose(chrome);
+	}
+	for (enum stage s = 0; s < NUM_STAGES; ++s)
+	{
+		print_hist(s);
+	}
+	free(rec);
+	return 0;
+}
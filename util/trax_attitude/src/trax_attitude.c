@@ -1,44 +1,352 @@
+/**
+ * Purpose: Show the attitude from the ahrs, or log every sample from it.
+ *
+ * Usage: trax_attitude [-l LOG_FILE [-p PREVIEW_HZ] [-s SYNC_SEC]] DEVICE
+ *
+ * Without -l, each new sample is printed as text. With -l, every sample is
+ * instead appended to LOG_FILE (which is replaced if it exists) as a fixed
+ * size binary record, and the attitude is only printed PREVIEW_HZ times a
+ * second (default 0, never). Logging stops on SIGINT or SIGTERM.
+ *
+ * Records are built by a sample handler on the receive thread into one of
+ * two large buffers, and a writer thread writes out and fdatasync()s each
+ * buffer once it fills, or after SYNC_SEC (default 1) seconds, so the
+ * receive thread never waits on the disk and at most about SYNC_SEC seconds
+ * of samples are lost on a power cut. If the disk falls behind by a whole
+ * buffer, samples are dropped and counted instead.
+ *
+ * LOG_FILE begins with LOG_MAGIC followed by the little endian u32
+ * RECORD_SIZE, and then holds one record per sample, each RECORD_SIZE bytes,
+ * little endian:
+ *     u64  time, per ahrs_att_time()
+ *     f32  pitch, yaw, roll, per ahrs_att()
+ *     u8   heading status, per ahrs_headingstatus()
+ *     u8   reserved[3]
+ *     u32  datagrams failed so far, per ahrs_link_stats()
+ *     u32  samples dropped so far by the logger
+ */
+
 #define _POSIX_C_SOURCE 200809L
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <time.h>
-#include <inttypes.h>
+#include <unistd.h>
 
 #include "ahrs.h"
 #include "io.h"
 #include "io_ahrs.h"
 
 
+static unsigned char const LOG_MAGIC[8] = "TRAXREC";
+#define RECORD_SIZE 32U
+// Records per buffer, about 20 minutes at 50 Hz
+#define BUFFER_RECORDS 65536U
+
+static struct
+{
+	int fd;
+	struct timespec sync_interval;
+
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	// Filled by the sample handler. The other is either empty, or full
+	// and being written out, which the writer thread empties.
+	unsigned char *buf[2];
+	unsigned active;
+	size_t used[2]; // bytes
+	bool stopping;
+	uint32_t dropped;
+	int error; // errno of a failed write, or 0
+} logger = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER};
+
+static struct timespec to_timespec(double const sec)
+{
+	time_t const whole = (time_t)sec;
+	return (struct timespec){
+		.tv_sec = whole,
+		.tv_nsec = (long)((sec - (double)whole) * 1e9)};
+}
+
+static void print_attitude()
+{
+	printf("P: %f\tR: %f\tY: %f HS: %" PRIuFAST8 "\r", ahrs_att(PITCH),
+			ahrs_att(ROLL), ahrs_att(YAW), ahrs_headingstatus());
+	fflush(stdout);
+}
+
+static void put_le(unsigned char *const buf, uint64_t val, unsigned const n)
+{
+	for (unsigned i = 0; i < n; ++i, val >>= 8)
+	{
+		buf[i] = (unsigned char)val;
+	}
+}
+
+static void put_float(unsigned char *const buf, float const f)
+{
+	uint32_t bits;
+	memcpy(&bits, &f, sizeof(bits));
+	put_le(buf, bits, 4);
+}
+
+/*
+ * Sample handler, on the receive thread
+ */
+static void log_sample(struct ahrs_sample const *const sample)
+{
+	struct ahrs_link_stats link;
+	ahrs_link_stats(&link);
+	unsigned char rec[RECORD_SIZE] = {0};
+	put_le(rec, sample->time, 8);
+	put_float(rec + 8, sample->att[PITCH]);
+	put_float(rec + 12, sample->att[YAW]);
+	put_float(rec + 16, sample->att[ROLL]);
+	rec[20] = sample->headingstatus;
+	put_le(rec + 24, link.synced - link.accepted, 4);
+
+	pthread_mutex_lock(&logger.lock);
+	unsigned const a = logger.active;
+	if (logger.used[a] == BUFFER_RECORDS * RECORD_SIZE)
+	{
+		// waits on the writer thread
+		if (logger.used[!a])
+		{
+			++logger.dropped;
+			pthread_mutex_unlock(&logger.lock);
+			return;
+		}
+		logger.active = !a;
+		pthread_cond_signal(&logger.cond);
+	}
+	put_le(rec + 28, logger.dropped, 4);
+	unsigned const b = logger.active;
+	memcpy(logger.buf[b] + logger.used[b], rec, RECORD_SIZE);
+	logger.used[b] += RECORD_SIZE;
+	pthread_mutex_unlock(&logger.lock);
+}
+
+static int write_all(int const fd, unsigned char const *buf, size_t n)
+{
+	while (n)
+	{
+		ssize_t const written = write(fd, buf, n);
+		if (written < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return -1;
+		}
+		buf += written;
+		n -= (size_t)written;
+	}
+	return 0;
+}
+
+/*
+ * Writes out each buffer the sample handler is done with, or after
+ * sync_interval the partly filled one, until stopping.
+ */
+static void *writer(void *const arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&logger.lock);
+	for (;;)
+	{
+		unsigned const a = logger.active;
+		if (!logger.used[!a])
+		{
+			if (logger.stopping && !logger.used[a])
+			{
+				break;
+			}
+			struct timespec until;
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_sec += logger.sync_interval.tv_sec;
+			until.tv_nsec += logger.sync_interval.tv_nsec;
+			if (until.tv_nsec >= 1000000000L)
+			{
+				until.tv_nsec -= 1000000000L;
+				++until.tv_sec;
+			}
+			if (!logger.stopping && pthread_cond_timedwait(&logger.cond,
+					&logger.lock, &until) != ETIMEDOUT)
+			{
+				continue;
+			}
+			// take the partly filled buffer
+			if (!logger.used[a] || logger.used[!a])
+			{
+				continue;
+			}
+			logger.active = !a;
+		}
+
+		unsigned const full = !logger.active;
+		pthread_mutex_unlock(&logger.lock);
+		int const error = (write_all(logger.fd, logger.buf[full],
+				logger.used[full]) || fdatasync(logger.fd)) ? errno : 0;
+		pthread_mutex_lock(&logger.lock);
+		logger.used[full] = 0;
+		if (error && !logger.error)
+		{
+			logger.error = error;
+		}
+	}
+	pthread_mutex_unlock(&logger.lock);
+	return NULL;
+}
+
+static int log_open(char const *const path, double const sync_sec)
+{
+	logger.sync_interval = to_timespec(sync_sec);
+	for (unsigned i = 0; i < 2; ++i)
+	{
+		if (!(logger.buf[i] = malloc(BUFFER_RECORDS * RECORD_SIZE)))
+		{
+			fprintf(stderr, "Out of memory.\n");
+			return -1;
+		}
+	}
+
+	unsigned char header[sizeof(LOG_MAGIC) + 4];
+	memcpy(header, LOG_MAGIC, sizeof(LOG_MAGIC));
+	put_le(header + sizeof(LOG_MAGIC), RECORD_SIZE, 4);
+	if ((logger.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1 ||
+			write_all(logger.fd, header, sizeof(header)))
+	{
+		perror(path);
+		return -1;
+	}
+	return 0;
+}
+
+
 int main (int argc, char *argv[])
 {
-	if (argc < 2)
+	char const *log_path = NULL;
+	double preview_hz = 0., sync_sec = 1.;
+	int opt;
+	while ((opt = getopt(argc, argv, "l:p:s:")) != -1)
 	{
-		fprintf(stderr, "Please pass the name of the file acting as the ahrs on the command line.\n");
+		switch (opt)
+		{
+			case 'l':
+				log_path = optarg;
+				break;
+			case 'p':
+				preview_hz = atof(optarg);
+				break;
+			case 's':
+				sync_sec = atof(optarg);
+				break;
+			default:
+				optind = argc; // print usage
+				break;
+		}
+	}
+	if (optind != argc - 1 || preview_hz < 0. || sync_sec <= 0.)
+	{
+		fprintf(stderr, "Usage: %s [-l LOG_FILE [-p PREVIEW_HZ] "
+				"[-s SYNC_SEC]] DEVICE\n"
+				"DEVICE is the file acting as the ahrs.\n", argv[0]);
 		return -1;
 	}
 
 	io_init();
 	io_stdout_init();
-	io_ahrs_init(argv[1]);
+	io_ahrs_init(argv[optind]);
 	if (!io_ahrs)
 	{
 		return -1;
 	}
-	// This seems to help when connecting with the arduino as serial
-	// passthrough
-	nanosleep(&(struct timespec){.tv_sec = 8}, NULL);
+	// Generous, since an arduino as serial passthrough resets when the port
+	// is opened
+	if (ahrs_start(10000000U, false))
+	{
+		fprintf(stderr, "The ahrs didn't start.\n");
+		return -1;
+	}
 
-	ahrs_set_datacomp();
-	ahrs_cont_start();
-	io_ahrs_recv_start(ahrs_att_recv);
-	for (;;)
+	if (!log_path)
 	{
-		if (ahrs_att_update())
+		io_ahrs_recv_start(ahrs_att_recv);
+		for (;;)
 		{
-			printf("P: %f\tR: %f\tY: %f HS: %" PRIuFAST8 "\r", ahrs_att(PITCH),
-					ahrs_att(ROLL), ahrs_att(YAW), ahrs_headingstatus());
-			fflush(stdout);
+			if (ahrs_att_update())
+			{
+				print_attitude();
+			}
+			nanosleep(&(struct timespec){.tv_nsec = 1000000L}, NULL);
 		}
-		nanosleep(&(struct timespec){.tv_nsec = 1000000L}, NULL);
 	}
-	return 0;
+
+	// Handled by sigtimedwait() below, and blocked before the writer and
+	// receive threads are created so that they inherit the mask. The dlog
+	// drain thread, started by io_ahrs_init(), blocks every signal itself.
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	pthread_t writer_thread;
+	if (log_open(log_path, sync_sec) ||
+			pthread_create(&writer_thread, NULL, writer, NULL))
+	{
+		return -1;
+	}
+	if (ahrs_sample_handler_add(log_sample) ||
+			io_ahrs_recv_start(ahrs_att_recv))
+	{
+		fprintf(stderr, "Failed to start receiving.\n");
+		return -1;
+	}
+
+	struct timespec const preview_interval =
+		to_timespec(preview_hz > 0. ? 1. / preview_hz : 3600.);
+	while (sigtimedwait(&signals, NULL, &preview_interval) == -1)
+	{
+		if (preview_hz > 0. && ahrs_att_update())
+		{
+			print_attitude();
+		}
+	}
+
+	io_ahrs_recv_stop();
+	pthread_mutex_lock(&logger.lock);
+	logger.stopping = true;
+	pthread_cond_signal(&logger.cond);
+	pthread_mutex_unlock(&logger.lock);
+	pthread_join(writer_thread, NULL);
+
+	int ret = 0;
+	if (logger.error)
+	{
+		fprintf(stderr, "Failed writing %s: %s\n", log_path,
+				strerror(logger.error));
+		ret = -1;
+	}
+	if (close(logger.fd))
+	{
+		perror(log_path);
+		ret = -1;
+	}
+	if (logger.dropped)
+	{
+		fprintf(stderr, "%" PRIu32 " samples were dropped since the disk "
+				"fell behind.\n", logger.dropped);
+	}
+	io_ahrs_clean();
+	return ret;
 }
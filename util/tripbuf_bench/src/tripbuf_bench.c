@@ -0,0 +1,567 @@
+/**
+ * Purpose: Measure the latency of handing samples from the receive thread
+ * to a consumer, with the triple buffer of io_ahrs_pc.c and with
+ * alternatives to it, so the handoff can be chosen on data.
+ *
+ * Usage: tripbuf_bench [-p CPU] [-c CPU] [-d SECONDS] [-r RATE]
+ *                      [-m MECH[,MECH...]] [-l LOAD[,LOAD...]]
+ *
+ * A producer thread pinned to CPU -p (default 0) publishes a struct
+ * ahrs_sample stamped with the time, RATE times a second (default 1000, 0
+ * for back to back), for SECONDS (default 2). A consumer thread pinned to
+ * CPU -c (default 1, or 0 on a single cpu) takes each one as soon as it can
+ * and records how long after the stamp it got it. Samples overwritten before
+ * the consumer gets to them aren't counted, as with any triple buffer. MECH
+ * is one of
+ *     mutex    io_ahrs_tripbuf_offer() and io_ahrs_tripbuf_update() as
+ *              built in the library, which the consumer polls
+ *     atomic   a lock free triple buffer, its indices exchanged atomically,
+ *              which the consumer polls
+ *     seqlock  a single buffer guarded by io_ahrs_seqlock_*(), as used by
+ *              ahrs_att_snapshot(), which the consumer polls
+ *     futex    the atomic triple buffer, the consumer spinning briefly and
+ *              then sleeping on a futex until woken by the producer
+ * and LOAD is one of
+ *     none     nothing else running
+ *     light    a thread per cpu, busy a quarter of the time
+ *     heavy    a thread per cpu, always busy streaming through memory
+ *     over     four threads per cpu, always busy, so the cpus are
+ *              oversubscribed
+ * with every combination run by default. Load threads aren't pinned, so
+ * they compete with the producer and consumer.
+ *
+ * Prints a header line and then one line of CSV per combination, with
+ *     offers_per_s   samples published a second
+ *     updates_per_s  samples taken by the consumer a second
+ *     p50_ns, p99_ns, p999_ns, max_ns
+ *                    handoff latency percentiles
+ *
+ * Pinning to isolated cpus (eg isolcpus=) and a realtime policy for the
+ * process (eg chrt -f 50) give figures closer to a realtime deployment.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ahrs.h"
+#include "io_ahrs.h"
+
+
+// Failed polls a futex consumer spins for before sleeping
+#define SPIN_POLLS 1000U
+// Bytes a heavy load thread streams through
+#define LOAD_BYTES (8UL << 20)
+
+struct payload
+{
+	uint64_t stamp; // ns, CLOCK_MONOTONIC
+	struct ahrs_sample sample;
+};
+
+static uint64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000U + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Handoff mechanisms. publish() is only called by the producer, and take()
+ * by the consumer, which copies the newest sample to out and returns true
+ * if there is one it hasn't taken, else returns false, or blocks if the
+ * mechanism can.
+ */
+struct mech
+{
+	char const *name;
+	void (*publish)(struct payload const *in);
+	bool (*take)(struct payload *out);
+	void (*stop)(); // wakes a blocked take()
+};
+
+static atomic_bool stopping;
+
+// mutex: the library's triple buffer
+
+static struct payload lib_buf[3];
+
+static void mutex_publish(struct payload const *const in)
+{
+	lib_buf[io_ahrs_tripbuf_write()] = *in;
+	io_ahrs_tripbuf_offer();
+}
+
+static bool mutex_take(struct payload *const out)
+{
+	if (!io_ahrs_tripbuf_update())
+	{
+		return false;
+	}
+	*out = lib_buf[io_ahrs_tripbuf_read()];
+	return true;
+}
+
+// atomic: the clean index and a new flag, exchanged by either side
+
+#define ATOMIC_NEW 4U
+
+static struct payload atomic_buf[3];
+static atomic_uchar atomic_clean = 1;
+static unsigned char atomic_write = 0, atomic_read = 2;
+
+static void atomic_publish(struct payload const *const in)
+{
+	atomic_buf[atomic_write] = *in;
+	atomic_write = atomic_exchange_explicit(&atomic_clean,
+			atomic_write | ATOMIC_NEW, memory_order_acq_rel) & ~ATOMIC_NEW;
+}
+
+static bool atomic_take(struct payload *const out)
+{
+	if (!(atomic_load_explicit(&atomic_clean, memory_order_relaxed) &
+			ATOMIC_NEW))
+	{
+		return false;
+	}
+	atomic_read = atomic_exchange_explicit(&atomic_clean, atomic_read,
+			memory_order_acq_rel) & ~ATOMIC_NEW;
+	*out = atomic_buf[atomic_read];
+	return true;
+}
+
+// seqlock: the library's seqlock over a single buffer
+
+static struct payload seqlock_buf;
+static atomic_uint_fast64_t seqlock_published;
+
+static void seqlock_publish(struct payload const *const in)
+{
+	io_ahrs_seqlock_write_begin();
+	seqlock_buf = *in;
+	io_ahrs_seqlock_write_end();
+	atomic_fetch_add_explicit(&seqlock_published, 1, memory_order_release);
+}
+
+static bool seqlock_take(struct payload *const out)
+{
+	static uint_fast64_t taken;
+	uint_fast64_t const published =
+		atomic_load_explicit(&seqlock_published, memory_order_acquire);
+	if (published == taken)
+	{
+		return false;
+	}
+	unsigned seq;
+	do
+	{
+		seq = io_ahrs_seqlock_read_begin();
+		*out = seqlock_buf;
+	} while (io_ahrs_seqlock_read_retry(seq));
+	taken = published;
+	return true;
+}
+
+// futex: the atomic triple buffer, with a blocking take
+
+static atomic_uint futex_word; // count of publishes, to sleep on
+static atomic_bool futex_waiting;
+
+static long futex(atomic_uint *const word, int const op, unsigned const val)
+{
+	return syscall(SYS_futex, word, op, val, NULL, NULL, 0);
+}
+
+static void futex_publish(struct payload const *const in)
+{
+	atomic_publish(in);
+	atomic_fetch_add(&futex_word, 1);
+	if (atomic_exchange(&futex_waiting, false))
+	{
+		futex(&futex_word, FUTEX_WAKE_PRIVATE, 1);
+	}
+}
+
+static bool futex_take(struct payload *const out)
+{
+	for (unsigned i = 0; i < SPIN_POLLS; ++i)
+	{
+		if (atomic_take(out))
+		{
+			return true;
+		}
+	}
+	unsigned const seen = atomic_load(&futex_word);
+	atomic_store(&futex_waiting, true);
+	// Either the producer's publish after this is seen, or it sees
+	// futex_waiting and wakes this.
+	if (!atomic_take(out) && !atomic_load(&stopping))
+	{
+		futex(&futex_word, FUTEX_WAIT_PRIVATE, seen);
+		return atomic_take(out);
+	}
+	return true;
+}
+
+static void futex_stop()
+{
+	atomic_fetch_add(&futex_word, 1);
+	futex(&futex_word, FUTEX_WAKE_PRIVATE, 1);
+}
+
+static void no_stop()
+{
+}
+
+static struct mech const mechs[] = {
+	{"mutex", mutex_publish, mutex_take, no_stop},
+	{"atomic", atomic_publish, atomic_take, no_stop},
+	{"seqlock", seqlock_publish, seqlock_take, no_stop},
+	{"futex", futex_publish, futex_take, futex_stop}};
+#define NUM_MECHS (sizeof(mechs) / sizeof(mechs[0]))
+
+enum load
+{
+	LOAD_NONE,
+	LOAD_LIGHT,
+	LOAD_HEAVY,
+	LOAD_OVER,
+	NUM_LOADS
+};
+
+static char const *const load_name[NUM_LOADS] = {
+	[LOAD_NONE] = "none",
+	[LOAD_LIGHT] = "light",
+	[LOAD_HEAVY] = "heavy",
+	[LOAD_OVER] = "over"};
+
+static void *load_thread(void *const arg)
+{
+	enum load const load = (enum load)(uintptr_t)arg;
+	if (load == LOAD_LIGHT)
+	{
+		while (!atomic_load_explicit(&stopping, memory_order_relaxed))
+		{
+			uint64_t const until = now_ns() + 250000U;
+			while (now_ns() < until)
+			{
+			}
+			nanosleep(&(struct timespec){.tv_nsec = 750000}, NULL);
+		}
+		return NULL;
+	}
+
+	unsigned char *const mem = load == LOAD_HEAVY ? malloc(LOAD_BYTES) : NULL;
+	for (unsigned long i = 0;
+			!atomic_load_explicit(&stopping, memory_order_relaxed); ++i)
+	{
+		if (mem)
+		{
+			// a cache line at a time
+			mem[(i * 64U) % LOAD_BYTES] += 1U;
+		}
+	}
+	free(mem);
+	return NULL;
+}
+
+struct run
+{
+	struct mech const *mech;
+	uint64_t period_ns; // between publishes, 0 for back to back
+	uint64_t duration_ns;
+	int producer_cpu, consumer_cpu;
+
+	uint64_t start_ns;
+	bool failed; // to pin a thread
+	unsigned long offers;
+	uint64_t *latency; // ns, of each sample taken
+	size_t nlatency, cap;
+};
+
+static int pin(int const cpu)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	int const err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	if (err)
+	{
+		fprintf(stderr, "Can't pin to cpu %d: %s\n", cpu, strerror(err));
+		return -1;
+	}
+	return 0;
+}
+
+static void *producer(void *const arg)
+{
+	struct run *const run = arg;
+	if (pin(run->producer_cpu))
+	{
+		run->failed = true;
+		atomic_store(&stopping, true);
+		run->mech->stop();
+		return NULL;
+	}
+	struct payload p = {0};
+	uint64_t const start = now_ns();
+	uint64_t next = start;
+	while (next - start < run->duration_ns)
+	{
+		if (run->period_ns)
+		{
+			next += run->period_ns;
+			struct timespec const ts = {
+				.tv_sec = next / 1000000000U,
+				.tv_nsec = next % 1000000000U};
+			while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL)
+					== EINTR)
+			{
+			}
+		}
+		else
+		{
+			next = now_ns();
+		}
+		p.sample.time = run->offers;
+		p.stamp = now_ns();
+		run->mech->publish(&p);
+		++run->offers;
+	}
+	atomic_store(&stopping, true);
+	run->mech->stop();
+	return NULL;
+}
+
+static void *consumer(void *const arg)
+{
+	struct run *const run = arg;
+	if (pin(run->consumer_cpu))
+	{
+		run->failed = true;
+		atomic_store(&stopping, true);
+		return NULL;
+	}
+	struct payload p;
+	while (!atomic_load_explicit(&stopping, memory_order_relaxed))
+	{
+		// skipping any left over from the last run
+		if (!run->mech->take(&p) || p.stamp < run->start_ns)
+		{
+			continue;
+		}
+		uint64_t const latency = now_ns() - p.stamp;
+		if (run->nlatency < run->cap)
+		{
+			run->latency[run->nlatency++] = latency;
+		}
+	}
+	return NULL;
+}
+
+static int compare_u64(void const *const a, void const *const b)
+{
+	uint64_t const x = *(uint64_t const *)a, y = *(uint64_t const *)b;
+	return (x > y) - (x < y);
+}
+
+static uint64_t percentile(struct run const *const run, double const p)
+{
+	if (!run->nlatency)
+	{
+		return 0;
+	}
+	size_t const i = (size_t)(p * (double)(run->nlatency - 1) + .5);
+	return run->latency[i];
+}
+
+static int bench(struct run *const run, enum load const load)
+{
+	long const ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned const nload = load == LOAD_NONE ? 0 :
+		(unsigned)(ncpus > 0 ? ncpus : 1) * (load == LOAD_OVER ? 4U : 1U);
+	pthread_t *const loaders = calloc(nload ? nload : 1, sizeof(pthread_t));
+	if (!loaders)
+	{
+		fprintf(stderr, "Out of memory.\n");
+		return -1;
+	}
+
+	atomic_store(&stopping, false);
+	run->start_ns = now_ns();
+	run->failed = false;
+	run->offers = 0;
+	run->nlatency = 0;
+	int ret = 0;
+	unsigned nstarted = 0;
+	for (; nstarted < nload; ++nstarted)
+	{
+		if (pthread_create(&loaders[nstarted], NULL, load_thread,
+				(void *)(uintptr_t)load))
+		{
+			fprintf(stderr, "Failed to start load.\n");
+			ret = -1;
+			break;
+		}
+	}
+
+	pthread_t prod, cons;
+	if (!ret)
+	{
+		if (pthread_create(&cons, NULL, consumer, run))
+		{
+			fprintf(stderr, "Failed to start the consumer.\n");
+			ret = -1;
+		}
+		else
+		{
+			if (pthread_create(&prod, NULL, producer, run))
+			{
+				fprintf(stderr, "Failed to start the producer.\n");
+				atomic_store(&stopping, true);
+				ret = -1;
+			}
+			else
+			{
+				pthread_join(prod, NULL);
+			}
+			pthread_join(cons, NULL);
+		}
+	}
+	atomic_store(&stopping, true);
+	while (nstarted)
+	{
+		pthread_join(loaders[--nstarted], NULL);
+	}
+	free(loaders);
+	if (ret || run->failed)
+	{
+		return -1;
+	}
+
+	qsort(run->latency, run->nlatency, sizeof(run->latency[0]), compare_u64);
+	double const sec = run->duration_ns * 1e-9;
+	printf("%s,%s,%.0f,%.0f,%llu,%llu,%llu,%llu\n", run->mech->name,
+			load_name[load], run->offers / sec, run->nlatency / sec,
+			(unsigned long long)percentile(run, .5),
+			(unsigned long long)percentile(run, .99),
+			(unsigned long long)percentile(run, .999),
+			(unsigned long long)percentile(run, 1.));
+	fflush(stdout);
+	return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+	long const ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int producer_cpu = 0, consumer_cpu = ncpus > 1 ? 1 : 0;
+	double seconds = 2., rate = 1000.;
+	bool run_mech[NUM_MECHS] = {false}, run_load[NUM_LOADS] = {false};
+	bool any_mech = false, any_load = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "p:c:d:r:m:l:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'p':
+				producer_cpu = atoi(optarg);
+				break;
+			case 'c':
+				consumer_cpu = atoi(optarg);
+				break;
+			case 'd':
+				seconds = atof(optarg);
+				break;
+			case 'r':
+				rate = atof(optarg);
+				break;
+			case 'm':
+				for (char *name = strtok(optarg, ","); name;
+						name = strtok(NULL, ","))
+				{
+					size_t m = 0;
+					while (m < NUM_MECHS && strcmp(name, mechs[m].name))
+					{
+						++m;
+					}
+					if (m == NUM_MECHS)
+					{
+						fprintf(stderr, "Unknown mechanism %s\n", name);
+						return -1;
+					}
+					run_mech[m] = any_mech = true;
+				}
+				break;
+			case 'l':
+				for (char *name = strtok(optarg, ","); name;
+						name = strtok(NULL, ","))
+				{
+					enum load l = 0;
+					while (l < NUM_LOADS && strcmp(name, load_name[l]))
+					{
+						++l;
+					}
+					if (l == NUM_LOADS)
+					{
+						fprintf(stderr, "Unknown load %s\n", name);
+						return -1;
+					}
+					run_load[l] = any_load = true;
+				}
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-p CPU] [-c CPU] [-d SECONDS] "
+						"[-r RATE] [-m MECH[,MECH...]] [-l LOAD[,LOAD...]]\n",
+						argv[0]);
+				return -1;
+		}
+	}
+	if (seconds <= 0. || rate < 0.)
+	{
+		fprintf(stderr, "SECONDS must be positive and RATE not negative.\n");
+		return -1;
+	}
+
+	struct run run = {
+		.period_ns = rate > 0. ? (uint64_t)(1e9 / rate) : 0,
+		.duration_ns = (uint64_t)(seconds * 1e9),
+		.producer_cpu = producer_cpu,
+		.consumer_cpu = consumer_cpu,
+		// back to back, a sample can't be taken much faster than this
+		.cap = rate > 0. ? (size_t)(seconds * rate) + 1 :
+			(size_t)(seconds * 2e7)};
+	if (!(run.latency = malloc(run.cap * sizeof(run.latency[0]))))
+	{
+		fprintf(stderr, "Out of memory.\n");
+		return -1;
+	}
+
+	printf("mech,load,offers_per_s,updates_per_s,p50_ns,p99_ns,p999_ns,"
+			"max_ns\n");
+	int ret = 0;
+	for (enum load l = 0; l < NUM_LOADS && !ret; ++l)
+	{
+		for (size_t m = 0; m < NUM_MECHS && !ret; ++m)
+		{
+			if ((!any_load || run_load[l]) && (!any_mech || run_mech[m]))
+			{
+				run.mech = &mechs[m];
+				ret = bench(&run, l);
+			}
+		}
+	}
+	free(run.latency);
+	return ret;
+}